@@ -0,0 +1,305 @@
+#!/usr/bin/env node
+
+// Copyright (c) 2020-2021, Bo Gao <7zlaser@gmail.com>
+
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+// SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THE
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Protocol benchmarks on the emulated adapter, times are virtual and reproducible
+// Usage: node bench.js [--check], --check fails on round trip or bitrate regressions
+
+const fs=require("fs");
+const os=require("os");
+const path=require("path");
+const UsbJtag=require("./usbjtag");
+const {UsbEmu, EmuTap}=require("./usbemu");
+const {SvfPlayer}=require("./svf");
+
+// Regression budgets, maximum round trips, minimum Mbps of payload, maximum packets, maximum TCK cycles and maximum ms
+const BUDGET={
+	fpgaRstSram: {rt: 1, tck: 90},
+	fpgaSequence: {rt: 1, tck: 180, pkts: 4},
+	fpgaReadId: {rt: 1},
+	fpgaReadCdn: {rt: 1},
+	fpgaWriteSram: {rt: 3, mbps: 6.0, pkts: 1300},
+	fpgaWriteSramRaw: {rt: 3, mbps: 6.0},
+	fpgaWriteSramFs: {rt: 6, mbps: 6.0, pkts: 1300},
+	fpgaWriteFlash: {rt: 12, mbps: 0.6},
+	flashRead: {rt: 1, mbps: 5.0},
+	flashReadFile: {rt: 1, mbps: 5.0},
+	fpgaWriteFlashDiff: {rt: 12, ms: 450},
+	fpgaRstPwr: {rt: 1, ms: 25},
+	fpgaPwrCycle: {rt: 3, ms: 30},
+	fpgaWriteSramAll: {rt: 3, mbps: 24.0},
+	svfRun: {rt: 1, mbps: 1.2},
+	svfRunCached: {rt: 1, mbps: 1.2},
+	fpgaCapture: {rt: 2, mbps: 0.65},
+	jtagBitbang: {rt: 1, mbps: 0.75},
+	jtagScan: {rt: 1, mbps: 1.25},
+};
+
+// Pseudo-random bitstream image with zero runs and blank padding pages
+function benchImage(len) {
+	const buf=Buffer.alloc(len);
+	for(let i=0, x=1;i<len;i++) {x=(x*1103515245+12345)>>>0; buf[i]=(i&0x3fff)>=0x3800?0xff:(i&0xff)<0x60?0x00:x>>>24;}
+	return buf;
+}
+
+// Gowin .fs text of an image, 256 bits per line
+function benchFs(buf) {
+	const lines=["//Device: GW1NZ-1", "//Bench image"];
+	for(let i=0;i<buf.length;i+=32) lines.push(Array.from(buf.subarray(i, i+32), (b)=> b.toString(2).padStart(8, "0")).join(""));
+	return lines.join("\r\n")+"\r\n";
+}
+
+// SVF of an ID check, SRAM reset, program and TDO checked readback, image bits are shifted MSB first
+function benchSvf(buf, id) {
+	const rev=Array.from({length: 256}, (_, b)=> (parseInt(b.toString(2).padStart(8, "0").split("").reverse().join(""), 2)).toString(16).padStart(2, "0"));
+	const hex=Array.from(buf, (b)=> rev[b]).reverse().join("").toUpperCase();
+	const n=buf.length*8, sir=(v)=> `SIR 8 TDI (${v});`;
+	return ["! Bench SVF", "TRST OFF;", "ENDIR IDLE;", "ENDDR IDLE;", "STATE RESET;", "STATE IDLE;", sir("11"), `SDR 32 TDI (00000000) TDO (${id}) MASK (0FFFFFFF);`,
+		sir("15"), sir("05"), sir("02"), "RUNTEST 20000 TCK;", sir("09"), sir("3A"), sir("02"), "RUNTEST IDLE 8 TCK ENDSTATE IDLE;",
+		sir("15"), sir("12"), sir("17"), `SDR ${n} TDI (${hex});`, sir("3A"), sir("02"), "RUNTEST 1.0E-03 SEC;",
+		sir("15"), sir("03"), `SDR ${n} TDI (00)`, `  TDO (${hex});`, sir("3A"), sir("02")].join("\n")+"\n";
+}
+
+async function benchRun(name, jtag, emu, fn, bytes=0) {
+	const a=emu.stats();
+	const ret=await fn();
+	const b=emu.stats();
+	const us=b.time-a.time;
+	const pkts=b.outPackets-a.outPackets+b.inPackets-a.inPackets;
+	return {name, ret, us, pkts, rt: b.roundTrips-a.roundTrips, out: b.outPackets-a.outPackets, in: b.inPackets-a.inPackets, tck: b.clocks-a.clocks, mbps: bytes?bytes*8/us:0};
+}
+
+// Program n emulated adapters concurrently, time is the slowest adapter and rate is aggregate
+async function benchAll(n, file, img) {
+	const emus=Array.from({length: n}, (_, i)=> new UsbEmu({sn: `EMU${i}`}));
+	const jtags=await UsbJtag.openAll(emus);
+	const a=emus.map((e)=> e.stats());
+	const res=await UsbJtag.runAll(jtags, (j)=> j.fpgaWriteSram(file));
+	const b=emus.map((e)=> e.stats());
+	const sum=(f)=> b.reduce((s, x, i)=> s+f(x)-f(a[i]), 0);
+	const us=Math.max(...b.map((x, i)=> x.time-a[i].time));
+	const ok=jtags.every((j, i)=> j.sn==`EMU${i}` && !res[i].err) && emus.every((e)=> img.equals(Buffer.from(e.tap.sram)));
+	return {name: "fpgaWriteSramAll", ret: ok, us, pkts: sum((x)=> x.outPackets+x.inPackets), rt: Math.max(...b.map((x, i)=> x.roundTrips-a[i].roundTrips)), out: sum((x)=> x.outPackets), in: sum((x)=> x.inPackets), tck: sum((x)=> x.clocks), mbps: img.length*n*8/us};
+}
+
+// Bitbang n bytes in Idle with TMS low, as full TMS and TDI bitbang packets or as TMS-low scans
+function benchBitbang(n, scan) {
+	const pkts=[];
+	for(let i=0;i<n;) {
+		const k=Math.min(scan?58:31, n-i), tdi=Array.from({length: k}, (_, j)=> (i+j)*29&0xff);
+		pkts.push(Buffer.from(scan?[0x01, 0x04, 0x00, 0x00, 0x00, 0x08, ...tdi]:[0x01, 0x00, ...new Array(k).fill(0), ...tdi]));
+		i+=k;
+	}
+	return pkts;
+}
+
+// Capture IDCODE samples, counted, stopped then abandoned, every sample must read the ID
+async function benchCapture(jtag, emu) {
+	const id=Buffer.from([0x1b, 0x68, 0x00, 0x01]), ok=(b)=> b.length%4==0 && b.length && Array.from({length: b.length>>2}, (_, i)=> b.subarray(i*4, i*4+4)).every((v)=> v.equals(id));
+	const cnt=await benchRun("fpgaCapture", jtag, emu, async ()=> {
+		const bufs=[];
+		for await(const b of await jtag.fpgaCapture(0x11, 32, {count: 4000})) bufs.push(b);
+		return Buffer.concat(bufs);
+	}, 4000*4);
+	cnt.ret=cnt.ret.length==4000*4 && ok(cnt.ret);
+	const stop=await benchRun("fpgaCaptureStop", jtag, emu, async ()=> {
+		const bufs=[], s=await jtag.fpgaCapture(0x11, 32);
+		let len=0;
+		for await(const b of s) {bufs.push(b); len+=b.length; if(len>=1000*4) s.stop();}
+		return Buffer.concat(bufs);
+	});
+	stop.ret=stop.ret.length>=1000*4 && ok(stop.ret) && (await jtag.fpgaReadId())=="0100681b";
+	let len=0; // Abandoned without stop, the stream must stop and drain it so the next response is not a stale sample
+	for await(const b of await jtag.fpgaCapture(0x11, 32)) if((len+=b.length)>=1000*4) break;
+	stop.ret=stop.ret && (await jtag.fpgaReadId())=="0100681b";
+	return [cnt, stop];
+}
+
+// Calibrate an adapter whose wiring carries SPI divider 4 and padding 2, then program SRAM at that rate
+async function benchCal(file, img) {
+	const emu=new UsbEmu({link: {div: 4, pad: 2}});
+	const jtag=new UsbJtag;
+	await jtag.open(emu);
+	const cal=await benchRun("calibrate", jtag, emu, ()=> jtag.calibrate());
+	const rom=await jtag.mcuReadRate(true);
+	cal.ret=cal.ret.div==4 && cal.ret.pad==2 && rom.div==4 && rom.pad==2;
+	const prog=await benchRun("fpgaWriteSramCal", jtag, emu, ()=> jtag.fpgaWriteSram(file), img.length);
+	prog.ret=img.equals(Buffer.from(emu.tap.sram));
+	return [cal, prog];
+}
+
+// Reprogram flash holding img with an image that differs in two sectors, then read the flash back to a file
+async function benchFlashDiff(file, img) {
+	const emu=new UsbEmu;
+	const jtag=new UsbJtag;
+	const upd=Buffer.from(img), back=file.replace(/\.bin$/, ".back.bin");
+	upd.fill(0x5a, 0x3100, 0x3140); upd.fill(0xff, 0x11000, 0x12000);
+	emu.flash.mem.set(img);
+	await fs.promises.writeFile(file, upd);
+	await jtag.open(emu);
+	const diff=await benchRun("fpgaWriteFlashDiff", jtag, emu, ()=> jtag.fpgaWriteFlash(file, true, true), upd.length);
+	diff.ret=diff.ret.sectors==2 && upd.equals(emu.flash.mem.subarray(0, upd.length));
+	const rd=await benchRun("flashReadFile", jtag, emu, ()=> jtag.flashReadFile(back, 0, upd.length), upd.length);
+	rd.ret=upd.equals(await fs.promises.readFile(back));
+	await fs.promises.unlink(back);
+	await fs.promises.writeFile(file, img);
+	return [diff, rd];
+}
+
+// Hard reset and power cycle an FPGA that boots from flash, the adapter waits until it is ready instead of fixed delays
+async function benchPwr(img) {
+	const emu=new UsbEmu;
+	const jtag=new UsbJtag;
+	emu.flash.mem.set(img.subarray(0, 0x1000));
+	await jtag.open(emu);
+	const rst=await benchRun("fpgaRstPwr", jtag, emu, ()=> jtag.fpgaRstPwr());
+	rst.ret=!rst.ret.timeout.length && rst.ret.cfg>0;
+	const cyc=await benchRun("fpgaPwrCycle", jtag, emu, async ()=> {await jtag.mcuWriteReg(0x0e, 0); await jtag.mcuWriteReg(0x0f, 0); return jtag.batch().readPwr().rstTap().readCdn().exec();});
+	cyc.ret=!cyc.ret[0].timeout.length && cyc.ret[0].off>0 && cyc.ret[0].rail>0 && cyc.ret[1];
+	const slowEmu=new UsbEmu({tap: new EmuTap(undefined, 150000)}); // Boots past the read timeout, then past PWR_CFG_MS
+	slowEmu.flash.mem.set(img.subarray(0, 0x1000));
+	await jtag.open(slowEmu);
+	const slow=await benchRun("fpgaRstPwrSlow", jtag, slowEmu, ()=> jtag.fpgaRstPwr());
+	slow.ret=!slow.ret.timeout.length && slow.ret.cfg>100;
+	slowEmu.tap.boot=300000;
+	const tmo=await benchRun("fpgaRstPwrTmo", jtag, slowEmu, ()=> jtag.fpgaRstPwr());
+	tmo.ret=tmo.ret.timeout.join()=="cfg" && tmo.ret.cfg>=200;
+	return [rst, cyc, slow, tmo];
+}
+
+// Program an image that ends mid-sector and holds blank pages over flash full of old data, the erase plan and page engine must leave exactly the image
+async function benchFlashModel(file) {
+	const emu=new UsbEmu;
+	const jtag=new UsbJtag;
+	const img=Buffer.from(Array.from({length: 0x11234}, (_, i)=> i*13+7&0xff)), old=Buffer.from(Array.from({length: 0x20000}, (_, i)=> i*29+3&0x7f));
+	img.fill(0xff, 0x4000, 0x4300); img.fill(0xff, 0x6000, 0x7000); img.fill(0xff, 0x8000, 0x80ff); // Blank pages and a page blank but for its last byte
+	emu.flash.mem.set(old);
+	await fs.promises.writeFile(file, img);
+	await jtag.open(emu);
+	const r=await benchRun("flashModel", jtag, emu, ()=> jtag.fpgaWriteFlash(file), img.length);
+	const mem=emu.flash.mem;
+	r.ret=r.ret.prog==img.length-0x1300 && img.equals(mem.subarray(0, img.length)) && mem.subarray(img.length, 0x12000).every((v)=> v==0xff) && old.subarray(0x12000).equals(mem.subarray(0x12000, 0x20000));
+	await fs.promises.unlink(file);
+	return r;
+}
+
+// SRAM images whose run over 128 bytes starts with 2 to 5 bytes of packet room left, a split must not leave a 1-byte run
+async function benchRle(file) {
+	const emu=new UsbEmu;
+	const jtag=new UsbJtag;
+	await jtag.open(emu);
+	let ok=true;
+	const r=await benchRun("fpgaWriteSramRle", jtag, emu, async ()=> {
+		for(let p=50;p<=60;p++) {
+			const img=Buffer.concat([Buffer.from(Array.from({length: p}, (_, i)=> i*37+1&0xff)), Buffer.alloc(129), Buffer.from([0x55]), Buffer.alloc(4000, 0xff), Buffer.from([0x12, 0x34])]);
+			await fs.promises.writeFile(file, img);
+			await jtag.fpgaWriteSram(file);
+			ok=ok && img.equals(Buffer.from(emu.tap.sram));
+		}
+	});
+	r.ret=ok;
+	await fs.promises.unlink(file);
+	return r;
+}
+
+async function main() {
+	const check=process.argv.includes("--check");
+	const img=benchImage(128*1024);
+	const file=path.join(os.tmpdir(), `usbjtag-bench-${process.pid}.bin`);
+	const fsFile=file.replace(/\.bin$/, ".fs");
+	const svfFile=file.replace(/\.bin$/, ".svf");
+	await fs.promises.writeFile(file, img);
+	await fs.promises.writeFile(fsFile, benchFs(img));
+	await fs.promises.writeFile(svfFile, benchSvf(img, "0100681B"));
+	const emu=new UsbEmu;
+	const jtag=new UsbJtag;
+	jtag.fsCache=await fs.promises.mkdtemp(path.join(os.tmpdir(), "usbjtag-cache-"));
+	await jtag.open(emu);
+	let fsOk=true, svfOk=true;
+	const res=[];
+	try {
+		res.push(await benchRun("fpgaRstSram", jtag, emu, ()=> jtag.fpgaRstSram()));
+		res.push(await benchRun("fpgaReadId", jtag, emu, ()=> jtag.fpgaReadId()));
+		res.push(await benchRun("fpgaSequence", jtag, emu, ()=> jtag.batch().rstSram().readId().readCdn().exec()));
+		res.push(await benchRun("fpgaWriteSram", jtag, emu, ()=> jtag.fpgaWriteSram(file), img.length));
+		emu.tap.sram=[]; jtag.rle=false;
+		res.push(await benchRun("fpgaWriteSramRaw", jtag, emu, ()=> jtag.fpgaWriteSram(file), img.length));
+		jtag.rle=true;
+		res.push(await benchRun("fpgaReadCdn", jtag, emu, ()=> jtag.fpgaReadCdn()));
+		for(const name of ["fpgaWriteSramFs", "fpgaWriteSramFsCached"]) {
+			emu.tap.sram=[];
+			res.push(await benchRun(name, jtag, emu, ()=> jtag.fpgaWriteSram(fsFile), img.length));
+			fsOk=fsOk && img.equals(Buffer.from(emu.tap.sram));
+		}
+		res.push(await benchRun("fpgaWriteFlash", jtag, emu, ()=> jtag.fpgaWriteFlash(file), img.length));
+		res.push(await benchFlashModel(file.replace(/\.bin$/, ".model.bin")));
+		res.push(await benchRle(file.replace(/\.bin$/, ".rle.bin")));
+		for(const name of ["svfRun", "svfRunCached"]) {
+			emu.tap.sram=[];
+			res.push(await benchRun(name, jtag, emu, ()=> new SvfPlayer(jtag).run(svfFile), img.length*2));
+			svfOk=svfOk && img.equals(Buffer.from(emu.tap.sram)) && res[res.length-1].ret.cached==(name=="svfRunCached");
+		}
+		res.push(await benchRun("flashRead", jtag, emu, ()=> jtag.flashRead(0, 0x8000), 0x8000));
+		res.push(...await benchFlashDiff(file, img));
+		res.push(...await benchCapture(jtag, emu));
+		await jtag.batch().goto("IDLE").exec();
+		res.push(await benchRun("jtagBitbang", jtag, emu, ()=> jtag.usbWritePipe(benchBitbang(0x8000, false)), 0x8000));
+		res.push(await benchRun("jtagScan", jtag, emu, ()=> jtag.usbWritePipe(benchBitbang(0x8000, true)), 0x8000));
+		res.push(await benchAll(4, file, img));
+		res.push(...await benchCal(file, img));
+		res.push(...await benchPwr(img));
+	}
+	finally {
+		await fs.promises.unlink(file);
+		await fs.promises.unlink(fsFile);
+		await fs.promises.unlink(svfFile);
+		await fs.promises.rm(jtag.fsCache, {recursive: true, force: true});
+	}
+	let fail=0;
+	const get=(name)=> res.find((r)=> r.name==name);
+	if(res[2].ret[0]!="0100681b" || res[2].ret[1]!==false) {console.log("Error: unexpected sequence result."); fail++;}
+	if(res[1].ret!="0100681b") {console.log("Error: unexpected JTAG ID "+res[1].ret); fail++;}
+	if(!res[4].ret || !img.equals(Buffer.from(emu.tap.sram))) {console.log("Error: SRAM image mismatch."); fail++;}
+	if(!fsOk) {console.log("Error: .fs SRAM image mismatch."); fail++;}
+	if(!svfOk) {console.log("Error: SVF SRAM image mismatch."); fail++;}
+	if(!img.equals(emu.flash.mem.subarray(0, img.length))) {console.log("Error: flash image mismatch."); fail++;}
+	if(!get("flashModel").ret) {console.log("Error: flash model mismatch."); fail++;}
+	if(!get("fpgaWriteSramRle").ret) {console.log("Error: compressed stream run split mismatch."); fail++;}
+	if(!img.subarray(0, 0x8000).equals(get("flashRead").ret)) {console.log("Error: flash readback mismatch."); fail++;}
+	if(!get("fpgaWriteFlashDiff").ret || !get("flashReadFile").ret) {console.log("Error: incremental flash or readback mismatch."); fail++;}
+	if(!["fpgaRstPwr", "fpgaPwrCycle", "fpgaRstPwrSlow", "fpgaRstPwrTmo"].every((n)=> get(n).ret)) {console.log("Error: power sequencing mismatch."); fail++;}
+	if(!get("fpgaCapture").ret || !get("fpgaCaptureStop").ret) {console.log("Error: capture sample mismatch."); fail++;}
+	if(!get("fpgaWriteSramAll").ret) {console.log("Error: multi-adapter SRAM image mismatch."); fail++;}
+	if(!get("calibrate").ret || !get("fpgaWriteSramCal").ret) {console.log("Error: calibration mismatch."); fail++;}
+	console.log("Operation              Time(ms)  Pkts  OUT   IN    RT   TCK      Pkts/s   Mbps");
+	for(const r of res) {
+		console.log(`${r.name.padEnd(22)} ${(r.us/1000).toFixed(2).padStart(8)} ${String(r.pkts).padStart(5)} ${String(r.out).padStart(5)} ${String(r.in).padStart(4)} ${String(r.rt).padStart(5)} ${String(r.tck).padStart(8)} ${(r.pkts*1e6/r.us).toFixed(0).padStart(8)} ${r.mbps?r.mbps.toFixed(2).padStart(6):"     -"}`);
+		const bud=BUDGET[r.name];
+		if(check && bud && (r.rt>bud.rt || (bud.mbps && r.mbps<bud.mbps) || (bud.pkts && r.pkts>bud.pkts) || (bud.tck && r.tck>bud.tck) || (bud.ms && r.us>bud.ms*1000))) {console.log(`Error: ${r.name} over budget.`); fail++;}
+	}
+	process.exit(fail?-1:0);
+}
+
+main();
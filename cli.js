@@ -25,48 +25,107 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 const util=require("util");
+const fs=require("fs");
+const {pipeline}=require("stream/promises");
 const exec=util.promisify(require("child_process").exec);
 const UsbJtag=require("./usbjtag");
+const {UsbEmu}=require("./usbemu");
+const {XvcServer}=require("./xvc");
+const {SvfPlayer}=require("./svf");
+const {UsbDaemon, DaemonLink, DAEMON_SOCK}=require("./daemon");
+const {UsbTracer}=require("./trace");
 const jtag=new UsbJtag;
+const daemon=process.env.USBJTAG_DAEMON=="1"?DAEMON_SOCK:process.env.USBJTAG_DAEMON; // Daemon socket, 1 for the default path
+let tracer=null;
 
 async function cliOpen() {
-	try {await jtag.open();} catch(e) {console.log(e); process.exit(-1);}
+	try { // USBJTAG_DAEMON goes through a running daemon, USBJTAG_EMU selects the emulated adapter, USBJTAG_SN an adapter by serial number
+		if(daemon) await (await (await new DaemonLink().connect(daemon)).acquire(process.env.USBJTAG_SN||null)).jtag(jtag);
+		else await jtag.open(process.env.USBJTAG_EMU?new UsbEmu:process.env.USBJTAG_SN||null);
+	}
+	catch(e) {console.log(e); process.exit(-1);}
+	if(jtag.stale) console.error("Warning: adapter firmware is out of date, run \"make flash\" to rebuild and flash usbjtag.bin.");
+	if(process.env.USBJTAG_TRACE) tracer=new UsbTracer().attach(jtag); // USBJTAG_TRACE records transfers to a trace file
 	process.on("SIGINT", ()=> {jtag.close();});
 }
 
-function cliClose(ret) {jtag.close(); process.exit(ret);}
+// Daemon sessions hand the adapter back before exit, a trace is saved and summarized
+async function cliClose(ret) {
+	if(tracer) {await tracer.dump(process.env.USBJTAG_TRACE); for(const l of UsbTracer.format(UsbTracer.report(tracer.records()))) console.log(l);}
+	await jtag.close();
+	process.exit(ret);
+}
+
+// Open all adapters, USBJTAG_EMU=N emulates N adapters
+async function cliOpenAll() {
+	const n=parseInt(process.env.USBJTAG_EMU);
+	const jtags=daemon?await Promise.all((await DaemonLink.list(daemon)).map((a)=> DaemonLink.open(a.sn, daemon))):await UsbJtag.openAll(process.env.USBJTAG_EMU?Array.from({length: n>1?n:1}, (_, i)=> new UsbEmu({sn: `EMU${i}`})):UsbJtag.devices());
+	if(!jtags.length) {console.log("Error: cannot find USB device."); process.exit(-1);}
+	jtags.forEach((j, i)=> {if(!j.sn) j.sn=`#${i}`;});
+	process.on("SIGINT", ()=> {jtags.forEach((j)=> j.close());});
+	return jtags;
+}
 
 function cliHelp() {
 	const name=__filename.slice(__dirname.length+1);
 	console.log("USBJTAG for Gowin GW1NZ FPGAs\nUsage:");
-	console.log(`    node ${name} read <ctl|ctl_rom|sn|vbus>`);
-	console.log(`    node ${name} write <ctl|ctl_rom|sn|spi|sram|flash|mcu> <value|bytes*|file>`);
+	console.log(`    node ${name} read <ctl|ctl_rom|sn|vbus|power|stats|rate|list>`);
+	console.log(`    node ${name} write <ctl|ctl_rom|sn|spi|sram|flash|svf|rate|mcu> <value|bytes*|file>`);
+	console.log(`    node ${name} write sram <file> --all`);
+	console.log(`    node ${name} write flash <file> --diff`);
+	console.log(`    node ${name} read flash <file> <length> [address]`);
+	console.log(`    node ${name} serve xvc [port]`);
+	console.log(`    node ${name} serve daemon [socket]`);
+	console.log(`    node ${name} capture <ir> <bits> <file> [count]`);
+	console.log(`    node ${name} trace <file>`);
+	console.log(`    node ${name} replay <file> [timed]`);
+	console.log("    rate: <divider:padding> sets and saves the SPI clock divider and bitbang padding, auto calibrates them.");
+	console.log("    daemon: keeps adapters open for commands run with USBJTAG_DAEMON=<socket>, 1 for the default socket.");
+	console.log("    trace: summarizes a trace recorded with USBJTAG_TRACE=<file>, replay: runs one on the adapter at full speed or with recorded timing.");
+	console.log("    --diff: compares flash sector CRCs on the adapter and only erases and programs the 4 KiB sectors that changed.");
+	console.log("    capture: repeats a DR read of bits after the hex IR and saves the samples, count 0 or none runs until Ctrl-C.");
 	console.log("    *: SPI bytes are space separated and SPI transactions are 's' splitted.")
 	console.log("Copyright (c) 2020-2021, Bo Gao, licensed under BSD 3-clause license.");
 }
 
+function cliPwr(p) {return `Power off: ${p.off.toFixed(2)} ms\nRail settle: ${p.rail.toFixed(2)} ms\nConfiguration: ${p.cfg.toFixed(2)} ms${p.timeout.length?"\nTimeout: "+p.timeout.join(", "):""}`;}
+
 async function cliRead(dest) {
 	try {
 		if(dest=="ctl") {await cliOpen(); console.log("CTL: "+("0"+(await jtag.mcuReadReg(0)).toString(16)).slice(-2)); cliClose(0);}
 		else if(dest=="ctl_rom") {await cliOpen(); console.log("CTL_ROM: "+("0"+(await jtag.mcuReadReg(1)).toString(16)).slice(-2)); cliClose(0);}
 		else if(dest=="vbus") {await cliOpen(); console.log("VBUS: "+(await jtag.mcuReadVbus()).toFixed(2)+"V"); cliClose(0);}
-		else if(dest=="sn") {await cliOpen(); console.log("SN: "+await jtag.mcuReadSn()); cliClose(0);}
+		else if(dest=="power") {await cliOpen(); console.log(cliPwr(await jtag.mcuReadPwr())); cliClose(0);}
+		else if(dest=="sn") {await cliOpen(); console.log("SN: "+(jtag.sn||await jtag.mcuReadSn())); cliClose(0);}
+		else if(dest=="rate") {
+			await cliOpen();
+			const r=await jtag.mcuReadRate(false), s=await jtag.mcuReadRate(true);
+			console.log(`Rate: SPI ${(16/r.div).toFixed(2)} MHz, divider ${r.div}, padding ${r.pad}\nRate_ROM: ${s.div>=2 && s.div<=64 && s.pad<=64?`divider ${s.div}, padding ${s.pad}`:"unset"}`);
+			cliClose(0);
+		}
+		else if(dest=="list" && daemon) {for(const a of await DaemonLink.list(daemon)) console.log(`SN: ${a.sn}${a.busy?", busy":""}`); process.exit(0);} // Cached on the daemon, busy adapters are not waited for
+		else if(dest=="list") {const jtags=await cliOpenAll(); jtags.forEach((j)=> console.log("SN: "+j.sn)); await Promise.all(jtags.map((j)=> j.close())); process.exit(0);}
+		else if(dest=="stats") {
+			await cliOpen();
+			const st=await jtag.mcuReadStats();
+			console.log(`Commands: ctl ${st.cmd.ctl}, jtag ${st.cmd.jtag}, spi ${st.cmd.spi}, stream ${st.cmd.stream}, batch ${st.cmd.batch}\nStream packets: ${st.raw}`);
+			console.log(`Bitbang bits: ${st.bits}\nSPI bytes: ${st.spi}\nEP1 ring full: ${st.nak}\nEP2 IN spins: ${st.spin}\nBusy time: ${st.busy.toFixed(2)} ms`);
+			cliClose(0);
+		}
 		else cliHelp();
 	}
 	catch(e) {console.log(e); cliClose(-1);}
 }
 
-async function cliWrite(dest, val) {
+async function cliWrite(dest, val, diff=false) {
 	try {
 		if(dest=="ctl") {await cliOpen(); await jtag.mcuWriteReg(parseInt(val, 16), 0); cliClose(0);}
 		else if(dest=="ctl_rom") {await cliOpen(); await jtag.mcuWriteReg(parseInt(val, 16), 1); cliClose(0);}
 		else if(dest=="sn") {await cliOpen(); await jtag.mcuWriteSn(val); cliClose(0);}
 		else if(dest=="sram") {
 			await cliOpen();
-			await jtag.fpgaRstPwr();
-			await jtag.fpgaRstTap(); // Reset FPGA
-			await jtag.fpgaRstSram();
-			console.log("JTAG ID: "+await jtag.fpgaReadId()); // Read ID
+			const [id]=await jtag.batch().rstPwr().rstTap().rstSram().readId().exec(); // Reset FPGA and read ID
+			console.log("JTAG ID: "+id);
 			const tStart=process.hrtime(); // Start timing
 			const len=await jtag.fpgaWriteSram(val); // Program SRAM
 			const tProg=process.hrtime(tStart);
@@ -78,19 +137,33 @@ async function cliWrite(dest, val) {
 		}
 		else if(dest=="flash") {
 			await cliOpen();
-			await jtag.fpgaRstCfg();
-			await jtag.fpgaRstTap(); // Reset FPGA
-			await jtag.fpgaRstSram();
+			await jtag.fpgaRstCfg(); // Reset FPGA and clear SRAM
 			console.log("JTAG ID: "+await jtag.fpgaReadId()); // Read ID
 			const tStart=process.hrtime(); // Start timing
-			const len=await jtag.fpgaWriteFlash(val); // Program flash
+			const st=await jtag.fpgaWriteFlash(val, true, diff); // Program flash, changed sectors only with diff
 			const tProg=process.hrtime(tStart);
 			const tProgMs=tProg[0]*1000+tProg[1]/1000000;
-			const cfgDone=await jtag.fpgaReadCdn(); // Check CDONE status
-			console.log(`CDONE status: ${cfgDone?"success":"fail"}\nFile size: ${(len/1024).toFixed(2)} KiB\nElapsed time: ${tProgMs.toFixed(2)} ms\nAverage bitrate: ${(len/125/tProgMs).toFixed(2)} Mbps`);
+			const [pwr, cfgDone]=await jtag.batch().rstPwr().readPwr().rstTap().readCdn().exec(); // Reload from flash, the adapter waits until the FPGA is ready, and check CDONE status
+			console.log(cliPwr(pwr));
+			console.log(`CDONE status: ${cfgDone?"success":"fail"}\nFile size: ${(st.len/1024).toFixed(2)} KiB\nProgrammed: ${(st.prog/1024).toFixed(2)} KiB, ${((st.len-st.prog)/1024).toFixed(2)} KiB blank skipped${diff?`\nChanged sectors: ${st.sectors} of ${Math.ceil(st.len/4096)}`:""}`);
+			console.log(`Erase time: ${st.tErase.toFixed(2)} ms\nProgram time: ${st.tProg.toFixed(2)} ms\nVerify time: ${st.tVerify.toFixed(2)} ms\nElapsed time: ${tProgMs.toFixed(2)} ms\nAverage bitrate: ${(st.len/125/tProgMs).toFixed(2)} Mbps`);
 			if(!cfgDone) throw("Error: Flash bitstream corrupted.");
 			cliClose(0);
 		}
+		else if(dest=="rate") {
+			await cliOpen();
+			if(val=="auto") {const r=await jtag.calibrate(); console.log(`JTAG ID: ${r.id}\nRate: SPI ${r.mhz.toFixed(2)} MHz, divider ${r.div}, padding ${r.pad}`);}
+			else {const [div, pad]=val.split(":").map((v)=> parseInt(v)); if(isNaN(div) || isNaN(pad)) throw("Error: invalid rate."); await jtag.mcuWriteRate(div, pad, true);}
+			cliClose(0);
+		}
+		else if(dest=="svf") {
+			await cliOpen();
+			const tStart=process.hrtime(); // Start timing
+			const st=await new SvfPlayer(jtag).run(val); // Compile or load from cache, then replay
+			const tRun=process.hrtime(tStart);
+			console.log(`Compiled: ${(st.len/1024).toFixed(2)} KiB${st.cached?", from cache":""}\nPackets: ${st.out} OUT, ${st.in} IN\nElapsed time: ${(tRun[0]*1000+tRun[1]/1000000).toFixed(2)} ms`);
+			cliClose(0);
+		}
 		else if(dest=="mcu") {
 			await cliOpen();
 			const ctl=await jtag.mcuReadReg(1);
@@ -109,6 +182,33 @@ async function cliWrite(dest, val) {
 	catch(e) {console.log(e); cliClose(-1);}
 }
 
+async function cliWriteSramAll(val) {
+	const jtags=await cliOpenAll();
+	let fail=0;
+	try {
+		for await(const b of jtags[0].imageLoad(val)); // Parse once, the other adapters load from cache
+		const tStart=process.hrtime(); // Start timing
+		const res=await UsbJtag.runAll(jtags, async (j)=> { // Reset, program SRAM and check CDONE status on each adapter
+			await j.batch().rstPwr().rstTap().rstSram().exec();
+			const len=await j.fpgaWriteSram(val);
+			if(!await j.fpgaReadCdn()) throw("Error: SRAM bitstream corrupted.");
+			return len;
+		});
+		const tProg=process.hrtime(tStart);
+		const tProgMs=tProg[0]*1000+tProg[1]/1000000;
+		let len=0;
+		for(const r of res) {
+			if(r.err) {console.log(`${r.sn}: ${r.err}`); fail++; continue;}
+			len+=r.ret;
+			console.log(`${r.sn}: ${(r.ret/1024).toFixed(2)} KiB, ${r.ms.toFixed(2)} ms, ${(r.ret/125/r.ms).toFixed(2)} Mbps`);
+		}
+		console.log(`Devices: ${res.length-fail} of ${res.length} programmed\nElapsed time: ${tProgMs.toFixed(2)} ms\nAggregate bitrate: ${(len/125/tProgMs).toFixed(2)} Mbps`);
+	}
+	catch(e) {console.log(e); fail++;}
+	await Promise.all(jtags.map((j)=> j.close()));
+	process.exit(fail?-1:0);
+}
+
 async function cliWriteSpi(val) {
 	let opened=false;
 	try {
@@ -139,13 +239,96 @@ async function cliWriteSpi(val) {
 	catch(e) {console.log(e); if(opened) cliClose(-1);}
 }
 
+async function cliCapture(ir, bits, file, count="0") {
+	try {
+		if(!/^[0-9a-fA-F]{1,2}$/.test(ir) || !/^[0-9]+$/.test(bits) || !/^[0-9]+$/.test(count)) {cliHelp(); process.exit(-1);}
+		await cliOpen();
+		const s=await jtag.fpgaCapture(parseInt(ir, 16), +bits, {count: +count});
+		process.removeAllListeners("SIGINT");
+		process.on("SIGINT", ()=> {s.stop();}); // Stop the capture, the stream ends on the zero-length packet
+		const tStart=process.hrtime(); // Start timing
+		let len=0;
+		s.on("data", (b)=> {len+=b.length;});
+		await pipeline(s, fs.createWriteStream(file));
+		const tRun=process.hrtime(tStart);
+		const tRunMs=tRun[0]*1000+tRun[1]/1000000;
+		console.log(`Samples: ${len/s.sampleSize}, ${s.sampleSize} bytes each\nElapsed time: ${tRunMs.toFixed(2)} ms\nSample rate: ${(len/s.sampleSize/tRunMs).toFixed(2)} kS/s`);
+		cliClose(0);
+	}
+	catch(e) {console.log(e); cliClose(-1);}
+}
+
+async function cliTrace(file) {
+	try {for(const l of UsbTracer.format(UsbTracer.report(await UsbTracer.load(file)))) console.log(l); process.exit(0);}
+	catch(e) {console.log(e); process.exit(-1);}
+}
+
+async function cliReplay(file, mode) {
+	try {
+		if(mode && mode!="timed") {cliHelp(); process.exit(-1);}
+		const recs=await UsbTracer.load(file);
+		await cliOpen();
+		const st=await UsbTracer.replay(jtag, recs, {timed: mode=="timed"});
+		console.log(`Transfers: ${st.transfers}, ${st.errs} errors, ${st.diff} IN mismatches\nRecorded time: ${(UsbTracer.report(recs).us/1000).toFixed(2)} ms\nElapsed time: ${(st.us/1000).toFixed(2)} ms`);
+		cliClose(0);
+	}
+	catch(e) {console.log(e); cliClose(-1);}
+}
+
+async function cliReadFlash(file, len, adr="0") {
+	try {
+		len=parseInt(len); adr=parseInt(adr);
+		if(isNaN(len) || isNaN(adr)) {cliHelp(); process.exit(-1);}
+		await cliOpen();
+		const tStart=process.hrtime(); // Start timing
+		await jtag.flashReadFile(file, adr, len);
+		const t=process.hrtime(tStart), ms=t[0]*1000+t[1]/1000000;
+		console.log(`File size: ${(len/1024).toFixed(2)} KiB\nElapsed time: ${ms.toFixed(2)} ms\nAverage bitrate: ${(len/125/ms).toFixed(2)} Mbps`);
+		cliClose(0);
+	}
+	catch(e) {console.log(e); cliClose(-1);}
+}
+
+async function cliServeDaemon(sock=DAEMON_SOCK) {
+	try {
+		const n=parseInt(process.env.USBJTAG_EMU);
+		const jtags=await UsbJtag.openAll(process.env.USBJTAG_EMU?Array.from({length: n>1?n:1}, (_, i)=> new UsbEmu({sn: `EMU${i}`})):UsbJtag.devices());
+		if(!jtags.length) {console.log("Error: cannot find USB device."); process.exit(-1);}
+		jtags.forEach((j, i)=> {if(!j.sn) j.sn=`#${i}`;});
+		const d=new UsbDaemon(jtags);
+		await d.init();
+		const srv=await d.listen(sock);
+		process.on("SIGINT", ()=> {srv.close(); jtags.forEach((j)=> j.close()); process.exit(0);});
+		console.log(`Daemon serving ${jtags.map((j)=> j.sn).join(", ")} on ${sock}`);
+	}
+	catch(e) {console.log(e); process.exit(-1);}
+}
+
+async function cliServe(proto, port) {
+	if(proto=="daemon") return await cliServeDaemon(port);
+	port=port||"2542";
+	try {
+		if(proto!="xvc" || !/^[0-9]+$/.test(port) || +port>65535) {cliHelp(); process.exit(-1);}
+		await cliOpen();
+		await new XvcServer(jtag).listen(+port, "0.0.0.0");
+		console.log(`XVC server listening on port ${port}`);
+	}
+	catch(e) {console.log(e); cliClose(-1);}
+}
+
 async function main() {
 	const argv=process.argv;
 	const argc=argv.length;
 	if(argc<=3) {cliHelp(); process.exit(-1);} // Invalid
-	if(argc==4) {if(argv[2]=="read") await cliRead(argv[3]); else {cliHelp(); process.exit(-1);}} // Read register
+	if(argc==4) {if(argv[2]=="read") await cliRead(argv[3]); else if(argv[2]=="serve") await cliServe(argv[3]); else if(argv[2]=="trace") await cliTrace(argv[3]); else if(argv[2]=="replay") await cliReplay(argv[3]); else {cliHelp(); process.exit(-1);}} // Read register, serve or trace
 	if(argc>=5) {
-		if(argc==5 && argv[2]=="write" && argv[3]!="spi") await cliWrite(argv[3], argv[4]); // Write register or file
+		if(argc==5 && argv[2]=="serve") await cliServe(argv[3], argv[4]); // Serve on port
+		else if(argc==5 && argv[2]=="replay") await cliReplay(argv[3], argv[4]); // Replay with recorded timing
+		else if(argc==6 && argv[2]=="write" && argv[3]=="sram" && argv[5]=="--all") await cliWriteSramAll(argv[4]); // Write SRAM on all adapters
+		else if(argc==6 && argv[2]=="write" && argv[3]=="flash" && argv[5]=="--diff") await cliWrite(argv[3], argv[4], true); // Write changed flash sectors
+		else if(argc==5 && argv[2]=="write" && argv[3]!="spi") await cliWrite(argv[3], argv[4]); // Write register or file
+		else if((argc==6 || argc==7) && argv[2]=="read" && argv[3]=="flash") await cliReadFlash(...argv.slice(4)); // Read flash to file
+		else if((argc==6 || argc==7) && argv[2]=="capture") await cliCapture(...argv.slice(3)); // Capture DR samples to file
 		else if(argv[2]=="write" && argv[3]=="spi") await cliWriteSpi(argv.slice(4, argv.length), false); // Write SPI
 		else {cliHelp(); process.exit(-1);}
 	}
@@ -0,0 +1,262 @@
+#!/usr/bin/env node
+
+// Copyright (c) 2020-2021, Bo Gao <7zlaser@gmail.com>
+
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+// SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THE
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Resident adapter daemon on a Unix socket, keeps adapters claimed and flushed between clients
+// Usage: node daemon.js, runs concurrent local clients against two emulated adapters
+
+const net=require("net");
+const fs=require("fs");
+const os=require("os");
+const path=require("path");
+const UsbJtag=require("./usbjtag");
+
+const DAEMON_SOCK=path.join(os.tmpdir(), "usbjtag.sock"); // Default socket path
+const OP={list: 0x01, acquire: 0x02, release: 0x03, tx: 0x04, rx: 0x05}; // Frame opcodes
+const STATES=UsbJtag.tapStates(); // TAP state codes, 0xff when unknown
+
+// Frame of [op, status, id, length, payload], status 0 is success and an error frame carries the message
+function frame(op, id, dat=Buffer.alloc(0), status=0) {
+	const hdr=Buffer.alloc(8);
+	hdr[0]=op; hdr[1]=status; hdr.writeUInt16LE(id, 2); hdr.writeUInt32LE(dat.length, 4);
+	return Buffer.concat([hdr, Buffer.from(dat)]);
+}
+
+// Split complete frames off a receive buffer, returns [frames, rest]
+function frames(buf) {
+	const ret=[];
+	while(buf.length>=8 && buf.length>=8+buf.readUInt32LE(4)) {
+		const len=buf.readUInt32LE(4);
+		ret.push({op: buf[0], status: buf[1], id: buf.readUInt16LE(2), dat: buf.subarray(8, 8+len)});
+		buf=buf.subarray(8+len);
+	}
+	return [ret, buf];
+}
+
+const stateCode=(s)=> s?STATES.indexOf(s):0xff;
+
+class UsbDaemon {
+	// Private members
+	#adps;
+
+	// jtags are opened adapters, each keeps its serial number, control byte and the TAP state the last client left
+	constructor(jtags) {this.#adps=jtags.map((jtag, i)=> ({jtag, i, sn: jtag.sn||`#${i}`, ctl: 0, state: null, owner: null, lock: Promise.resolve(), wait: 0}));}
+
+	// Read control bytes of all adapters
+	async init() {for(const a of this.#adps) a.ctl=await a.jtag.mcuReadReg(0);}
+
+	// Adapter list, [count, then sn[16], ctl, state, busy, queued per adapter]
+	list() {
+		const ret=Buffer.alloc(1+this.#adps.length*20);
+		ret[0]=this.#adps.length;
+		this.#adps.forEach((a, i)=> {const o=1+i*20; ret.write(a.sn.slice(0, 16), o); ret[o+16]=a.ctl; ret[o+17]=stateCode(a.state); ret[o+18]=a.owner?1:0; ret[o+19]=a.wait;});
+		return ret;
+	}
+
+	// Wait for the adapter, sessions take it in arrival order and one closed while queued hands it straight on
+	async acquire(a, sess) {
+		const prev=a.lock;
+		a.lock=new Promise((res)=> {sess.done=res;});
+		a.wait++;
+		await prev;
+		a.wait--;
+		if(sess.lost) {sess.done(); throw("Error: session closed.");}
+		a.owner=sess; sess.adp=a;
+	}
+
+	// Hand the adapter on once the session's transfers settle, an abandoned session leaves the state unknown and IN data flushed
+	async release(sess, state) {
+		const a=sess.adp;
+		if(!a) return;
+		sess.adp=null;
+		await Promise.allSettled(sess.pend);
+		if(state===undefined) {a.state=null; for(let i=0;i<4;i++) try {await a.jtag.rx(64);} catch(e) {break;}}
+		else a.state=state;
+		try {a.ctl=await a.jtag.mcuReadReg(0);} catch(e) {;}
+		a.owner=null;
+		sess.done();
+	}
+
+	// Serve one connection, transfers are passed to the adapter in arrival order and answered as they complete
+	serve(sock) {
+		const sess={adp: null, pend: new Set(), done: null, wait: false, lost: false};
+		let buf=Buffer.alloc(0);
+		const reply=(f, job)=> {
+			const p=job.then((r)=> sock.write(frame(f.op, f.id, r||Buffer.alloc(0))), (e)=> sock.write(frame(f.op, f.id, Buffer.from(String(e && e.message || e)), 1)));
+			sess.pend.add(p); p.then(()=> sess.pend.delete(p));
+		};
+		const run=(f)=> {
+			if(f.op==OP.list) reply(f, Promise.resolve(this.list()));
+			else if(f.op==OP.acquire) {
+				const sn=f.dat.toString(), a=sn?this.#adps.find((x)=> x.sn==sn):this.#adps[0];
+				if(!a || sess.adp || sess.wait) {reply(f, Promise.reject(a?"Error: adapter already acquired.":`Error: cannot find USB device ${sn}.`)); return;}
+				sess.wait=true;
+				reply(f, this.acquire(a, sess).then(()=> {sess.wait=false; return Buffer.concat([Buffer.from([a.i, a.ctl, stateCode(a.state)]), Buffer.from(a.sn)]);}));
+			}
+			else if(f.op==OP.release) reply(f, this.release(sess, f.dat.length && f.dat[0]<STATES.length?STATES[f.dat[0]]:null));
+			else if(!sess.adp) reply(f, Promise.reject("Error: no adapter acquired."));
+			else if(f.op==OP.tx) reply(f, sess.adp.jtag.tx(Buffer.from(f.dat)).then(()=> null));
+			else if(f.op==OP.rx) reply(f, sess.adp.jtag.rx(f.dat.readUInt16LE(0)));
+			else reply(f, Promise.reject("Error: invalid daemon command."));
+		};
+		sock.on("data", (d)=> {
+			let fl;
+			[fl, buf]=frames(Buffer.concat([buf, d]));
+			fl.forEach(run);
+		});
+		sock.on("error", ()=> {;});
+		sock.on("close", ()=> {sess.lost=true; if(sess.adp) this.release(sess);});
+	}
+
+	// Listen on a Unix socket, a stale socket file is replaced, resolves with the server
+	listen(sock=DAEMON_SOCK) {
+		try {if(fs.statSync(sock).isSocket()) fs.unlinkSync(sock);} catch(e) {;}
+		const srv=net.createServer((s)=> this.serve(s));
+		return new Promise((res, rej)=> {srv.once("error", rej); srv.listen(sock, ()=> res(srv));});
+	}
+}
+
+// Adapter session on a daemon, opened with UsbJtag.open like an emulated device
+// Transfers keep their pipelining over the socket, the TAP state is handed back to the daemon on close
+class DaemonLink {
+	// Private members
+	#sock;
+	#buf=Buffer.alloc(0);
+	#wait=new Map();
+	#id=0;
+	#jtag=null;
+
+	sn="";
+	ctl=0;
+	tapState=null;
+
+	// Connect to the daemon socket
+	async connect(sock=DAEMON_SOCK) {
+		this.#sock=net.connect(sock);
+		this.#sock.on("data", (d)=> {
+			let fl;
+			[fl, this.#buf]=frames(Buffer.concat([this.#buf, d]));
+			for(const f of fl) {
+				const w=this.#wait.get(f.id);
+				this.#wait.delete(f.id);
+				if(f.status) w.rej(new Error(f.dat.toString())); else w.res(f.dat);
+			}
+		});
+		this.#sock.on("close", ()=> {for(const w of this.#wait.values()) w.rej(new Error("Error: daemon connection closed.")); this.#wait.clear();});
+		await new Promise((res, rej)=> {this.#sock.once("connect", res); this.#sock.once("error", rej);});
+		this.#sock.on("error", ()=> {;});
+		return this;
+	}
+
+	#req(op, dat) {
+		const id=this.#id=(this.#id+1)&0xffff;
+		return new Promise((res, rej)=> {this.#wait.set(id, {res, rej}); this.#sock.write(frame(op, id, dat));});
+	}
+
+	// Adapters on the daemon, with the control byte and TAP state cached there
+	async list() {
+		const r=await this.#req(OP.list);
+		return Array.from({length: r[0]}, (_, i)=> {const o=1+i*20; return {sn: r.subarray(o, o+16).toString().replace(/\0/g, ""), ctl: r[o+16], tapState: STATES[r[o+17]]||null, busy: !!r[o+18], queued: r[o+19]};});
+	}
+
+	// Take an adapter by serial number, or the first one, waits while other clients hold it
+	async acquire(sn=null) {
+		const r=await this.#req(OP.acquire, Buffer.from(sn||""));
+		this.ctl=r[1]; this.tapState=STATES[r[2]]||null; this.sn=r.subarray(3).toString();
+		return this;
+	}
+
+	// Open a UsbJtag adapter on this session with the cached TAP state, it is handed back on close
+	async jtag(jtag=new UsbJtag) {
+		await jtag.open(this);
+		jtag.sn=this.sn;
+		return this.#jtag=jtag;
+	}
+
+	tx(buf) {return this.#req(OP.tx, Buffer.from(buf));}
+
+	rx(len) {const b=Buffer.alloc(2); b.writeUInt16LE(len); return this.#req(OP.rx, b);}
+
+	// Release the adapter with the TAP state the session leaves, and disconnect
+	async close() {
+		if(!this.#sock) return;
+		const st=this.#jtag?this.#jtag.tapState:null;
+		try {await this.#req(OP.release, Buffer.from([stateCode(st)]));} catch(e) {;}
+		this.#sock.end();
+		this.#sock=null;
+	}
+
+	// Connect and acquire, resolves with an opened UsbJtag
+	static async open(sn=null, sock=DAEMON_SOCK) {return await (await (await new DaemonLink().connect(sock)).acquire(sn)).jtag();}
+
+	// Adapters on the daemon
+	static async list(sock=DAEMON_SOCK) {
+		const link=await new DaemonLink().connect(sock);
+		try {return await link.list();} finally {link.#sock.end();}
+	}
+}
+
+// Two emulated adapters, concurrent clients on one must serialize and see the TAP state the previous one left
+async function main() {
+	const {UsbEmu}=require("./usbemu");
+	const sock=path.join(os.tmpdir(), `usbjtag-daemon-${process.pid}.sock`);
+	const emus=[new UsbEmu({sn: "EMU0"}), new UsbEmu({sn: "EMU1"})];
+	const jtags=await UsbJtag.openAll(emus);
+	const daemon=new UsbDaemon(jtags);
+	await daemon.init();
+	const srv=await daemon.listen(sock);
+	let fail=0;
+	const t=process.hrtime();
+	const order=[];
+	const client=async (k)=> {
+		const jtag=await DaemonLink.open("EMU0", sock);
+		const st=jtag.tapState;
+		order.push(k);
+		const id=await jtag.fpgaReadId();
+		await jtag.batch().idle(8).exec();
+		order.push(k);
+		await jtag.close();
+		return {id, st};
+	};
+	const res=await Promise.all([0, 1, 2, 3].map(client));
+	const j1=await DaemonLink.open("EMU1", sock);
+	const vbus=await j1.mcuReadVbus();
+	await j1.close();
+	const list=await DaemonLink.list(sock);
+	const d=process.hrtime(t);
+	if(res.some((r)=> r.id!="0100681b")) fail++;
+	if(res.filter((r)=> r.st=="IDLE").length!=3 || order.some((k, i)=> order[i&~1]!=k)) fail++; // Whole sessions run one after another
+	if(list.length!=2 || list[0].sn!="EMU0" || list[0].tapState!="IDLE" || list[0].ctl!=0x0f || list[1].busy) fail++;
+	if(!(vbus>0)) fail++;
+	console.log(`Adapters: ${list.map((a)=> `${a.sn} ctl ${a.ctl.toString(16)} ${a.tapState||"unknown"}`).join(", ")}`);
+	console.log(`Sessions: ${res.length+1}, ${(d[0]*1000+d[1]/1000000).toFixed(2)} ms, ${fail?"fail":"pass"}`);
+	srv.close();
+	for(const j of jtags) j.close();
+	process.exit(fail?-1:0);
+}
+
+if(require.main===module) main();
+
+module.exports={UsbDaemon, DaemonLink, DAEMON_SOCK};
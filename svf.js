@@ -0,0 +1,275 @@
+#!/usr/bin/env node
+
+
+// Copyright (c) 2020-2021, Bo Gao <7zlaser@gmail.com>
+
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+// SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THE
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// SVF player, statements are compiled into adapter packets once and replayed from a binary cache
+// Usage: node svf.js <file>, runs the file against the emulated adapter
+
+const fs=require("fs");
+const path=require("path");
+const crypto=require("crypto");
+const UsbJtag=require("./usbjtag");
+
+const SVF_VERSION=1; // Cache format version, bump when compiled output changes
+const SVF_SPI=64; // Shift bits through SPI fast path sub-commands from this length
+const SVF_STREAM=8192; // Shift bits through a stream from this length
+const SVF_IDLE=64; // Idle TCK counts up to this are clocked by scans, longer ones by pulse
+const SVF_PULSE=2; // Pulse TCK clocks per us, timer 2 clock output at 2 MHz
+const SVF_STATE={RESET: "RESET", IDLE: "IDLE", DRSELECT: "DRSEL", DRCAPTURE: "DRCAP", DRSHIFT: "DRSH", DREXIT1: "DREX1", DRPAUSE: "DRPAU", DREXIT2: "DREX2", DRUPDATE: "DRUPD",
+	IRSELECT: "IRSEL", IRCAPTURE: "IRCAP", IRSHIFT: "IRSH", IREXIT1: "IREX1", IRPAUSE: "IRPAU", IREXIT2: "IREX2", IRUPDATE: "IRUPD"};
+const HEX=Array.from({length: 128}, (_, c)=> parseInt(String.fromCharCode(c), 16));
+
+// Cache file: "USVF", version and record count as uint32, then records
+// OUT packet [0x00, len, data], IN check [0x01, len, line32, wait32, exp, mask], wait is the device time in ms since the previous check
+// Records are position independent and read through views, so replay never copies or parses them
+class SvfPlayer {
+	#jtag;
+
+	constructor(jtag) {this.#jtag=jtag;}
+
+	// Statements as words with the line they start on, '!' and '//' comments stripped, hex strings in parentheses are one word
+	static *parse(text) {
+		let stmt="", start=0, line=0;
+		for(let l of text.split("\n")) {
+			line++;
+			const c=l.search(/!|\/\//);
+			if(c>=0) l=l.slice(0, c);
+			for(let i;(i=l.indexOf(";"))>=0;l=l.slice(i+1)) {
+				if(!stmt.trim()) start=line;
+				stmt+=" "+l.slice(0, i);
+				const w=stmt.match(/\([^)]*\)|[^\s()]+/g);
+				if(w) yield {line: start, w};
+				stmt="";
+			}
+			if(!stmt.trim() && l.trim()) start=line;
+			stmt+=" "+l;
+		}
+		if(stmt.trim()) throw(`Error: missing ';' at line ${start}.`);
+	}
+
+	// Bits of a hex word, bit 0 is shifted first
+	static bits(w, n) {
+		if(!w || w[0]!="(") throw("Error: invalid SVF hex string.");
+		const s=w.slice(1, -1).replace(/\s/g, ""), b=new Uint8Array(n);
+		for(let i=0;i<n;i++) {
+			const k=s.length-1-(i>>2);
+			if(k<0) break;
+			const v=HEX[s.charCodeAt(k)];
+			if(isNaN(v)) throw("Error: invalid SVF hex string.");
+			b[i]=v>>(i&3)&1;
+		}
+		return b;
+	}
+
+	// Compile SVF text into cache records, the TAP state is unknown at the start so replay does not depend on it
+	compile(text) {
+		const jtag=new UsbJtag;
+		jtag.rle=this.#jtag.rle; jtag.rleRatio=this.#jtag.rleRatio;
+		const recs=[], reg={SIR: {n: -1}, SDR: {n: -1}, HIR: {n: 0}, TIR: {n: 0}, HDR: {n: 0}, TDR: {n: 0}};
+		let bat=jtag.batch(), want=[], wait=0, cnt=0, endir="IDLE", enddr="IDLE", run="IDLE", runEnd="IDLE", line=0;
+		const out=(pkt)=> {cnt++; wait+=pkt.length/500; recs.push(Buffer.from([0x00, pkt.length]), pkt);}; // Wait covers 4 Mbps of OUT data
+		const check=(exp, mask)=> {
+			const h=Buffer.alloc(10);
+			h[0]=0x01; h[1]=exp.length; h.writeUInt32LE(line, 2); h.writeUInt32LE(Math.ceil(wait), 6);
+			recs.push(h, Buffer.from(exp), Buffer.from(mask)); cnt++;
+			wait=0;
+		};
+		const flush=()=> {
+			let k=0;
+			for(const g of bat.build()) {
+				out(Buffer.from(g.dat));
+				if(!g.len) continue;
+				const exp=[], mask=[];
+				for(const c of g.cmds) if(c.len) {const w=want[k++]; exp.push(...w[0]); mask.push(...w[1]);}
+				check(exp, mask);
+			}
+			want=[];
+		};
+		const state=(w)=> {const s=SVF_STATE[w]; if(!s) throw(`Error: invalid SVF state at line ${line}.`); return s;};
+		const lsb=(b, s, n)=> {const r=new Array((n+7)>>3).fill(0); for(let i=0;i<n;i++) r[i>>3]|=b[s+i]<<(i&7); return r;};
+		const msb=(b, s, n)=> {const r=Buffer.alloc(n); for(let i=0;i<n*8;i++) r[i>>3]|=b[s+i]<<(7-(i&7)); return r;};
+
+		// Shift n bits and move to end, TDO is checked where exp is set
+		// Whole bytes go through a stream or SPI fast path sub-commands, the tail and the exit path through one scan
+		const shift=(ir, n, tdi, exp, mask, end)=> {
+			const sh=ir?"IRSH":"DRSH", ex=ir?"IREX1":"DREX1";
+			if(!n) {bat.goto(end); return;}
+			bat.goto(sh);
+			let i=0;
+			if(n-1>=SVF_STREAM) {
+				const len=(n-1)>>3, d=msb(tdi, 0, len), ones=(b)=> b.every((v)=> v==0xff);
+				flush();
+				if(exp) { // All ones TDI and mask fields are left out of the records
+					const m=msb(mask, 0, len);
+					for(const p of jtag.usbVerify(len, {tdi: ones(d)?null:d, exp: msb(exp, 0, len), mask: ones(m)?null:m})) out(p);
+					out(Buffer.from([0x03, 0x80]));
+					check([0, 0, 0xff, 0xff, 0xff, 0xff], [0, 0, 0xff, 0xff, 0xff, 0xff]);
+				}
+				else for(let k=0;k<len;k+=0x4000) for(const p of jtag.usbJtagStream(d.subarray(k, k+0x4000))) out(p);
+				bat=jtag.batch(); i=len*8;
+			}
+			for(;n-1-i>=SVF_SPI;) {
+				const len=Math.min(59, (n-1-i)>>3);
+				bat.raw(0x01, exp?0x03:0x02, [...msb(tdi, i, len)], exp?len:0);
+				if(exp) want.push([msb(exp, i, len), msb(mask, i, len)]);
+				i+=len*8;
+			}
+			const p=UsbJtag.tapPath(ex, end), k=n-i;
+			bat.scan(lsb(tdi, i, k), k, [0, 0], [p.reduce((t, v, j)=> t|v<<(j+1), 1), p.length+1], !!exp);
+			if(exp) want.push([lsb(exp, i, k), lsb(mask, i, k)]);
+		};
+
+		// Clock TCK in the run state for count cycles or at least us, delay only for SCK counts and times
+		const runtest=(count, clk, us)=> {
+			bat.goto(run);
+			if(clk=="TCK" && !us && count<=SVF_IDLE && run=="IDLE") bat.idle(count);
+			else {
+				let t=Math.ceil(Math.max(count/SVF_PULSE, us));
+				wait+=t/1000;
+				while(t>0) {
+					const ms=Math.min(255, Math.floor(t/1000)), u=Math.min(255, t-ms*1000);
+					if(clk=="TCK") bat.pulse(ms, u); else bat.delay(ms, u);
+					t-=ms*1000+u;
+				}
+			}
+			bat.goto(runEnd);
+		};
+
+		for(const s of SvfPlayer.parse(text)) {
+			const w=s.w, op=w[0].toUpperCase();
+			line=s.line;
+			if(op in reg) {
+				const r=reg[op], n=parseInt(w[1]);
+				if(!(n>=0)) throw(`Error: invalid SVF length at line ${line}.`);
+				if(n!=r.n) r.tdi=r.mask=null; // TDI and MASK persist while the length stays the same
+				r.n=n; r.tdo=null;
+				for(let i=2;i<w.length;i+=2) {
+					const k=w[i].toUpperCase();
+					if(k=="TDI") r.tdi=SvfPlayer.bits(w[i+1], n);
+					else if(k=="TDO") r.tdo=SvfPlayer.bits(w[i+1], n);
+					else if(k=="MASK") r.mask=SvfPlayer.bits(w[i+1], n);
+					else if(k!="SMASK") throw(`Error: invalid SVF parameter at line ${line}.`);
+				}
+				if(op[0]!="S") continue;
+				const ir=op=="SIR", parts=ir?[reg.HIR, r, reg.TIR]:[reg.HDR, r, reg.TDR]; // Header shifts first
+				const len=parts.reduce((t, p)=> t+p.n, 0), chk=parts.some((p)=> p.tdo);
+				const tdi=new Uint8Array(len), exp=chk?new Uint8Array(len):null, mask=chk?new Uint8Array(len):null;
+				let o=0;
+				for(const p of parts) {
+					if(p.tdi) tdi.set(p.tdi, o);
+					if(chk && p.tdo) {exp.set(p.tdo, o); if(p.mask) mask.set(p.mask, o); else mask.fill(1, o, o+p.n);}
+					o+=p.n;
+				}
+				shift(ir, len, tdi, exp, mask, ir?endir:enddr);
+			}
+			else if(op=="ENDIR") endir=state(w[1]);
+			else if(op=="ENDDR") enddr=state(w[1]);
+			else if(op=="STATE") {for(const x of w.slice(1)) {const st=state(x); if(st=="RESET") bat.rstTap(true); else bat.goto(st);}}
+			else if(op=="RUNTEST") {
+				let i=1, count=0, clk="TCK", us=0;
+				if(SVF_STATE[w[i]]) {run=runEnd=state(w[i++]);}
+				if(w[i+1]=="TCK" || w[i+1]=="SCK") {count=parseFloat(w[i]); clk=w[i+1]; i+=2;}
+				if(w[i+1]=="SEC") {us=parseFloat(w[i])*1e6; i+=2;}
+				if(w[i]=="MAXIMUM") i+=3;
+				if(w[i]=="ENDSTATE") {runEnd=state(w[i+1]); i+=2;}
+				if(i!=w.length || !(count>=0) || !(us>=0)) throw(`Error: invalid SVF RUNTEST at line ${line}.`);
+				runtest(count, clk, us);
+			}
+			else if(op!="FREQUENCY" && op!="TRST") throw(`Error: unsupported SVF command ${op} at line ${line}.`); // Clock rates are fixed and TRST is not wired
+		}
+		flush();
+		const hdr=Buffer.alloc(12);
+		hdr.write("USVF"); hdr.writeUInt32LE(SVF_VERSION, 4); hdr.writeUInt32LE(cnt, 8);
+		return Buffer.concat([hdr, ...recs]);
+	}
+
+	// Cache records, OUT packets as buffers and IN checks as objects, all views into buf
+	static *records(buf) {
+		if(buf.length<12 || buf.toString("latin1", 0, 4)!="USVF" || buf.readUInt32LE(4)!=SVF_VERSION) throw("Error: invalid SVF cache.");
+		let n=0, i=12;
+		for(;i+2<=buf.length;n++) {
+			const len=buf[i+1];
+			if(buf[i]==0x00) {yield buf.subarray(i+2, i+2+len); i+=2+len;}
+			else {yield {line: buf.readUInt32LE(i+2), wait: buf.readUInt32LE(i+6), exp: buf.subarray(i+10, i+10+len), mask: buf.subarray(i+10+len, i+10+2*len)}; i+=10+2*len;}
+		}
+		if(i!=buf.length || n!=buf.readUInt32LE(8)) throw("Error: invalid SVF cache.");
+	}
+
+	// Compiled records of an SVF file, cached by content hash with the same index as .fs files, returns {buf, cached}
+	async load(filename) {
+		const st=await fs.promises.stat(filename);
+		const key="svf:"+path.resolve(filename);
+		const jtag=this.#jtag;
+		let buf=await jtag.cacheGet(key, st, ".usvf");
+		if(buf) return {buf, cached: true};
+		const text=await fs.promises.readFile(filename);
+		const hash=crypto.createHash("sha256").update(text).update(`svf ${SVF_VERSION} ${jtag.rle} ${jtag.rleRatio}`).digest("hex");
+		buf=this.compile(text.toString("latin1"));
+		await jtag.cachePut(key, st, hash, ".usvf", buf);
+		return {buf, cached: false};
+	}
+
+	// Replay compiled records, OUT packets are pipelined while IN responses are checked in order
+	// Throws with the SVF line of the first TDO mismatch, the TAP state is unknown afterwards
+	async replay(buf) {
+		const jtag=this.#jtag, outs=[], ins=[];
+		for(const r of SvfPlayer.records(buf)) (Buffer.isBuffer(r)?outs:ins).push(r);
+		const rd=async ()=> { // Responses due after long device time are read alone with a timeout of twice that
+			let k=0;
+			for await(const r of jtag.usbReadPipe(ins.length, jtag.readDepth, ins.map((w)=> w.wait>=50?w.wait*2+100:0))) {
+				const w=ins[k++];
+				if(r.length!=w.exp.length) throw("Error: invalid response length.");
+				for(let i=0;i<r.length;i++) if((r[i]^w.exp[i])&w.mask[i]) throw(`Error: SVF TDO mismatch at line ${w.line}.`);
+			}
+		};
+		const res=await Promise.allSettled([jtag.usbWritePipe(outs), rd()]);
+		jtag.tapState=null;
+		for(const r of res) if(r.status=="rejected") throw(r.reason);
+		return {out: outs.length, in: ins.length};
+	}
+
+	// Run SVF file, returns packet counts and whether the compiled records came from cache
+	async run(filename) {
+		const {buf, cached}=await this.load(filename);
+		return {...await this.replay(buf), len: buf.length, cached};
+	}
+}
+
+// Run an SVF file against the emulated adapter
+async function main() {
+	const {UsbEmu}=require("./usbemu");
+	const jtag=new UsbJtag;
+	await jtag.open(new UsbEmu);
+	try {
+		const r=await new SvfPlayer(jtag).run(process.argv[2]);
+		console.log(`SVF: ${r.out} OUT and ${r.in} IN packets, ${(r.len/1024).toFixed(2)} KiB compiled${r.cached?", cached":""}`);
+	}
+	catch(e) {console.log(e); process.exit(-1);}
+}
+
+if(require.main===module) main();
+
+module.exports={SvfPlayer};
@@ -0,0 +1,231 @@
+#!/usr/bin/env node
+
+// Copyright (c) 2020-2021, Bo Gao <7zlaser@gmail.com>
+
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+// SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THE
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// USB transfer tracer, per-opcode latency report and trace replay
+// Usage: node trace.js, traces an emulated SRAM load and replays it on a fresh emulated adapter
+
+const fs=require("fs");
+
+const TRACE_VER=1;
+const REC=76; // Record bytes, [flags, length, transfer, submit us, duration us, packet]
+const F_IN=0x01, F_ERR=0x02, F_FIRST=0x04, F_RAW=0x08; // IN packet, failed transfer, first packet of a transfer, stream data
+const NAMES=["ctl", "jtag", "spi", "stream", "batch"];
+
+class UsbTracer {
+	// Private members
+	#ring;
+	#head=0;
+	#count=0;
+	#xfer=0;
+	#left=0;
+	#base;
+
+	// slots records are kept, the oldest are overwritten, clock returns microseconds
+	constructor({slots=65536, clock=null}={}) {
+		this.#ring=Buffer.alloc(slots*REC);
+		this.slots=slots;
+		this.#base=process.hrtime.bigint();
+		this.clock=clock||(()=> Number((process.hrtime.bigint()-this.#base)/1000n));
+	}
+
+	// Wrap the transfers of an opened adapter
+	attach(jtag) {
+		const tx=jtag.tx, rx=jtag.rx;
+		jtag.tx=async (buf)=> {
+			const t0=this.clock(), x=this.#xfer++;
+			try {await tx(buf);} catch(e) {this.#out(buf, x, t0, F_ERR); throw(e);}
+			this.#out(buf, x, t0, 0);
+		};
+		jtag.rx=async (len)=> {
+			const t0=this.clock(), x=this.#xfer++;
+			let r;
+			try {r=await rx(len);} catch(e) {this.#put(F_IN|F_FIRST|F_ERR, x, t0, Buffer.alloc(0)); throw(e);}
+			this.#put(F_IN|F_FIRST, x, t0, r);
+			return r;
+		};
+		return this;
+	}
+
+	// OUT transfer, split into packets, stream data after a stream header is marked as such
+	#out(buf, x, t0, err) {
+		buf=Buffer.from(buf);
+		for(let i=0;i<buf.length;i+=64) {
+			const p=buf.subarray(i, i+64);
+			let f=err|(i?0:F_FIRST);
+			if(this.#left) {f|=F_RAW; this.#left=Math.max(0, this.#left-p.length);}
+			else if(p[0]==0x03 && p.length>=6) {
+				const hdr=p[1]<=0x01 || p[1]==0x04?6:p[1]==0x02?10:p[1]==0x03?8+(p[7]|0):0;
+				if(hdr && p.length>=hdr) this.#left=Math.max(0, p.readUInt32LE(2)-(p.length-hdr));
+			}
+			this.#put(f, x, t0, p);
+		}
+	}
+
+	#put(f, x, t0, p) {
+		const o=this.#head*REC, t1=this.clock();
+		this.#ring[o]=f; this.#ring[o+1]=p.length; this.#ring.writeUInt16LE(x&0xffff, o+2);
+		this.#ring.writeUInt32LE(t0>>>0, o+4); this.#ring.writeUInt32LE(Math.max(0, t1-t0)>>>0, o+8);
+		p.copy(this.#ring, o+12);
+		this.#head=(this.#head+1)%this.slots;
+		if(this.#count<this.slots) this.#count++;
+	}
+
+	// Records oldest first
+	records() {
+		const ret=[];
+		for(let i=0, k=(this.#head-this.#count+this.slots)%this.slots;i<this.#count;i++, k=(k+1)%this.slots) ret.push(UsbTracer.record(this.#ring, k*REC));
+		return ret;
+	}
+
+	// Decode a record, times are unwrapped later against the previous record
+	static record(buf, o) {
+		const f=buf[o], len=buf[o+1];
+		return {in: !!(f&F_IN), err: !!(f&F_ERR), first: !!(f&F_FIRST), raw: !!(f&F_RAW), xfer: buf.readUInt16LE(o+2), t0: buf.readUInt32LE(o+4), dt: buf.readUInt32LE(o+8), data: Buffer.from(buf.subarray(o+12, o+12+len))};
+	}
+
+	// Write records to file, ["UTRC", version, count, records]
+	async dump(file) {
+		const recs=this.#count, hdr=Buffer.alloc(12);
+		hdr.write("UTRC"); hdr.writeUInt32LE(TRACE_VER, 4); hdr.writeUInt32LE(recs, 8);
+		const k=(this.#head-recs+this.slots)%this.slots;
+		const body=k+recs<=this.slots?this.#ring.subarray(k*REC, (k+recs)*REC):Buffer.concat([this.#ring.subarray(k*REC), this.#ring.subarray(0, this.#head*REC)]);
+		await fs.promises.writeFile(file, Buffer.concat([hdr, body]));
+		return recs;
+	}
+
+	// Read records from file, submit times are unwrapped to run on from the first record
+	static async load(file) {
+		const buf=await fs.promises.readFile(file);
+		if(buf.length<12 || buf.subarray(0, 4).toString()!="UTRC" || buf.readUInt32LE(4)!=TRACE_VER || buf.length<12+buf.readUInt32LE(8)*REC) throw("Error: invalid trace file.");
+		const ret=[];
+		let prev=0;
+		for(let i=0;i<buf.readUInt32LE(8);i++) {
+			const r=UsbTracer.record(buf, 12+i*REC);
+			r.t0=i?prev+((r.t0-prev)|0):r.t0; prev=r.t0; // Clock wraps after 71 minutes
+			ret.push(r);
+		}
+		return ret;
+	}
+
+	// Transfers from records, OUT packets of one transfer are joined
+	static transfers(recs) {
+		const ret=[];
+		for(const r of recs) {
+			if(r.first || !ret.length) ret.push({in: r.in, err: r.err, raw: r.raw, key: UsbTracer.key(r), xfer: r.xfer, t0: r.t0, t1: r.t0+r.dt, pkts: 1, data: [r.data]});
+			else {const x=ret[ret.length-1]; x.pkts++; x.data.push(r.data);}
+		}
+		for(const x of ret) x.data=Buffer.concat(x.data);
+		return ret;
+	}
+
+	// Histogram key, command name and argument of OUT packets
+	static key(r) {return r.in?"in":r.raw?"stream data":`${NAMES[r.data[0]]||"0x"+r.data[0].toString(16)} 0x${(r.data[1]|0).toString(16).padStart(2, "0")}`;}
+
+	// Per-key transfers, packets, bytes, latency p50, p99 and max in us, and log2 latency buckets
+	static report(recs) {
+		const xs=UsbTracer.transfers(recs), keys={};
+		for(const x of xs) {
+			const k=keys[x.key]=keys[x.key]||{key: x.key, count: 0, pkts: 0, bytes: 0, errs: 0, lat: [], hist: []};
+			const us=x.t1-x.t0, b=us<1?0:Math.floor(Math.log2(us))+1;
+			k.count++; k.pkts+=x.pkts; k.bytes+=x.data.length; k.errs+=x.err?1:0; k.lat.push(us);
+			k.hist[b]=(k.hist[b]||0)+1;
+		}
+		const pct=(a, p)=> a[Math.min(a.length-1, Math.floor(a.length*p))];
+		const rows=Object.values(keys).map((k)=> {k.lat.sort((a, b)=> a-b); const r={...k, p50: pct(k.lat, 0.5), p99: pct(k.lat, 0.99), max: k.lat[k.lat.length-1]}; delete r.lat; return r;});
+		rows.sort((a, b)=> b.count-a.count);
+		const t0=xs.reduce((t, x)=> Math.min(t, x.t0), Infinity), t1=xs.reduce((t, x)=> Math.max(t, x.t1), 0);
+		return {rows, transfers: xs.length, pkts: recs.length, us: xs.length?t1-t0:0, out: recs.filter((r)=> !r.in).reduce((t, r)=> t+r.data.length, 0), in: recs.filter((r)=> r.in).reduce((t, r)=> t+r.data.length, 0)};
+	}
+
+	// Report as text lines
+	static format(rep) {
+		const lines=[`Transfers: ${rep.transfers}, packets ${rep.pkts}, OUT ${rep.out} bytes, IN ${rep.in} bytes, ${(rep.us/1000).toFixed(2)} ms`, "Opcode         Xfers   Pkts     Bytes  Err   p50(us)   p99(us)   max(us)"];
+		for(const r of rep.rows) lines.push(`${r.key.padEnd(13)} ${String(r.count).padStart(6)} ${String(r.pkts).padStart(6)} ${String(r.bytes).padStart(9)} ${String(r.errs).padStart(4)} ${String(r.p50).padStart(9)} ${String(r.p99).padStart(9)} ${String(r.max).padStart(9)}`);
+		return lines;
+	}
+
+	// Replay transfers on an opened adapter, each is submitted once every transfer that had completed before it was submitted has completed again
+	// timed also waits for the recorded submit time, IN data that differs from the recording is counted
+	static async replay(jtag, recs, {timed=false}={}) {
+		const xs=UsbTracer.transfers(recs).sort((a, b)=> a.t0-b.t0), done=[...xs].sort((a, b)=> a.t1-b.t1);
+		const base=xs.length?xs[0].t0:0, start=process.hrtime.bigint();
+		const st={transfers: xs.length, errs: 0, diff: 0, us: 0};
+		let k=0;
+		for(const x of xs) {
+			const deps=[];
+			while(k<done.length && done[k].t1<=x.t0) {if(done[k].job) deps.push(done[k].job); k++;}
+			await Promise.all(deps);
+			if(timed) {const wait=x.t0-base-Number((process.hrtime.bigint()-start)/1000n); if(wait>0) await new Promise((res)=> setTimeout(res, wait/1000));}
+			const job=x.in?jtag.rx(64).then((r)=> {if(!x.err && !r.equals(x.data)) st.diff++;}):jtag.tx(x.data);
+			x.job=job.catch(()=> {if(!x.err) st.errs++;});
+		}
+		await Promise.all(xs.map((x)=> x.job));
+		st.us=Number((process.hrtime.bigint()-start)/1000n);
+		return st;
+	}
+}
+
+// Trace an emulated SRAM load and ID read, then replay the dump on a fresh emulated adapter at full speed and with recorded timing
+async function main() {
+	const os=require("os");
+	const path=require("path");
+	const UsbJtag=require("./usbjtag");
+	const {UsbEmu}=require("./usbemu");
+	const file=path.join(os.tmpdir(), `usbjtag-trace-${process.pid}`);
+	const img=Buffer.from(Array.from({length: 32768}, (_, i)=> (i*7919>>5^i)&0xff));
+	await fs.promises.writeFile(file+".bin", img);
+	let fail=0;
+	try {
+		const jtag=new UsbJtag;
+		await jtag.open(new UsbEmu);
+		const tr=new UsbTracer().attach(jtag);
+		await jtag.fpgaRstSram();
+		await jtag.fpgaWriteSram(file+".bin");
+		const id=await jtag.fpgaReadId();
+		await jtag.fpgaReadCdn();
+		const n=await tr.dump(file+".trc");
+		const recs=await UsbTracer.load(file+".trc");
+		const rep=UsbTracer.report(recs);
+		for(const l of UsbTracer.format(rep)) console.log(l);
+		if(id!="0100681b" || n!=recs.length || !rep.rows.find((r)=> r.key.startsWith("stream 0x")) || !rep.rows.find((r)=> r.key=="stream data")) fail++;
+		for(const timed of [false, true]) {
+			const emu=new UsbEmu, j=new UsbJtag;
+			await j.open(emu);
+			const st=await UsbTracer.replay(j, recs, {timed});
+			console.log(`Replay${timed?" timed":""}: ${st.transfers} transfers, ${st.errs} errors, ${st.diff} IN mismatches, ${(st.us/1000).toFixed(2)} ms`);
+			if(st.errs || st.diff || !img.equals(Buffer.from(emu.tap.sram.slice(0, img.length))) || (timed && st.us<rep.us*0.9)) fail++;
+		}
+	}
+	catch(e) {console.log(e); fail++;}
+	await fs.promises.rm(file+".bin", {force: true});
+	await fs.promises.rm(file+".trc", {force: true});
+	console.log(fail?"Trace replay: fail":"Trace replay: pass");
+	process.exit(fail?-1:0);
+}
+
+if(require.main===module) main();
+
+module.exports={UsbTracer};
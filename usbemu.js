@@ -0,0 +1,527 @@
+// Copyright (c) 2020-2021, Bo Gao <7zlaser@gmail.com>
+
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+// SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THE
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Emulated CH552 adapter, models usb_parse in usbjtag.c on a virtual clock in microseconds
+
+const CLK=16; // CPU cycles per us
+const FRAME=1000; // USB frame in us
+const OVH=13; // Bulk packet token, handshake, PID and CRC bytes
+
+// Firmware cycle costs, estimated from the code SDCC generates for the macros and loops in usbjtag.c
+const COST={
+	parse: 150, // Main loop poll and usb_parse dispatch per packet
+	stream: 60, // stm_write bookkeeping per stream packet
+	spiTx: 17, // spi_tx, movx, mov and 14 nops per byte
+	spiRx: 24, // spi_rx, spi_tx plus XBUS_AUX switches and movx store per byte
+	spiPut: 24, // spi_put, SPI0_DATA write and S0_FREE poll per byte
+	jtagTx: 26, // jtag_txb, TMS and TDI mask and bool, two SAFE_MOD++ and two TCK writes per bit
+	jtagRx: 32, // jtag_rxb, jtag_txb plus TDO test and OR per bit
+	jtagPath: 18, // jtag_path per bit
+	kern: {tx: [14, 14], rx: [16, 18], ltx: [7, 5], lrx: [9, 12]}, // Carry-rotate kernels per bit and per byte load with DJNZ, jtag_kw, jtag_kwr, jtag_kl and jtag_klr
+	kernCopy: 12, // jtag_write_read TDO copy from obuf to ibuf per byte
+	verify: 70, // stm_verify record fields and CRC per byte
+	pad: 4, // Two SAFE_MOD++ per bitbang bit at the default padding of 1
+	padStep: 6, // Two jtag_delay loop steps per bitbang bit for each padding step above 1
+	rleToken: 60, // stm_expand token decode and spi_write or spi_fill call
+	spiFill: 18, // spi_fill, unrolled spi_put per byte
+	spiFf: 22, // spi_ff, immediate 0xff TX, 16 nops and movx store per byte
+	crc: 32, // spi_crc, S0_FREE poll, next TX and two table lookups per byte while the byte shifts
+	crcSector: 150, // usb_sectors call, command and address per sector
+	pmu: 120*CLK, // pmu_write, three I2C bytes at udelay(1) half periods
+};
+
+// Power sequencing in us, modelled Vbus settling after the rail turns off and on, GW1NZ configuration times and the adc_settle and pwr_cfg poll periods
+// tmo holds the firmware phase timeouts, PWR_OFF_MS, PWR_RAIL_MS and PWR_CFG_MS
+const PWR={off: 1500, rail: 600, cfg: 18000, blank: 900, hold: 1000, jtagPoll: 180, adcPoll: 130, stable: 4, tmo: [10000, 5000, 200000]};
+
+// TAP state transitions for TMS 0 and 1
+const TAP={
+	RESET: ["IDLE", "RESET"], IDLE: ["IDLE", "DRSEL"],
+	DRSEL: ["DRCAP", "IRSEL"], DRCAP: ["DRSH", "DREX1"], DRSH: ["DRSH", "DREX1"], DREX1: ["DRPAU", "DRUPD"],
+	DRPAU: ["DRPAU", "DREX2"], DREX2: ["DRSH", "DRUPD"], DRUPD: ["IDLE", "DRSEL"],
+	IRSEL: ["IRCAP", "RESET"], IRCAP: ["IRSH", "IREX1"], IRSH: ["IRSH", "IREX1"], IREX1: ["IRPAU", "IRUPD"],
+	IRPAU: ["IRPAU", "IREX2"], IREX2: ["IRSH", "IRUPD"], IRUPD: ["IDLE", "DRSEL"],
+};
+
+// GW1NZ TAP with 8-bit IR, IDCODE, status and SRAM configuration registers
+class EmuTap {
+	// boot is the time in us the FPGA takes to load its design from flash
+	constructor(id=0x0100681b, boot=PWR.cfg) {this.id=id; this.boot=boot; this.clocks=0; this.power(false);}
+
+	// Power up or reset, done is set when the FPGA loaded a design from flash
+	power(done) {this.state="RESET"; this.ir=0x11; this.sr=0; this.cfg=false; this.sram=[]; this.done=done; this.acc=this.bits=this.pos=0;}
+
+	// Status register, bit 13 is CDONE
+	status() {return (this.done?0x2000:0)|(this.cfg?0x80:0);}
+
+	// Instruction update
+	update(ir) {
+		this.ir=ir;
+		if(ir==0x15) this.cfg=true; // Config enable
+		else if(ir==0x3a) {if(this.cfg && this.sram.length) this.done=true; this.cfg=false;} // Config disable
+		else if(this.cfg && (ir==0x05 || ir==0x12)) {this.sram=[]; this.done=false;} // Erase SRAM, init address
+	}
+
+	// Data register capture
+	capture() {
+		this.sr=0; this.len=1; this.pos=0; this.acc=this.bits=0;
+		if(this.ir==0x11) {this.sr=this.id; this.len=32;}
+		else if(this.ir==0x41) {this.sr=this.status(); this.len=32;}
+	}
+
+	// Data register shift, returns TDO
+	shift(tdi) {
+		if(this.ir==0x17 && this.cfg) {this.acc=this.acc<<1|tdi; if(++this.bits==8) {this.sram.push(this.acc&0xff); this.acc=this.bits=0;} return 0;} // Write SRAM, MSB first
+		if(this.ir==0x03) {const b=this.sram[this.pos>>3]; return b===undefined?0:b>>(7-(this.pos++&7))&1;} // Read SRAM
+		const tdo=this.sr&1;
+		this.sr=(this.sr>>>1|tdi<<(this.len-1))>>>0;
+		return tdo;
+	}
+
+	// Rising TCK edge, returns TDO sampled before the edge
+	clock(tms, tdi) {
+		let tdo=0;
+		this.clocks++;
+		if(this.state=="IRSH") {tdo=this.sr&1; this.sr=this.sr>>1|tdi<<7;}
+		else if(this.state=="DRSH") tdo=this.shift(tdi);
+		this.state=TAP[this.state][tms];
+		if(this.state=="RESET") this.ir=0x11;
+		else if(this.state=="IRCAP") this.sr=0x01;
+		else if(this.state=="IRUPD") this.update(this.sr);
+		else if(this.state=="DRCAP") this.capture();
+		return tdo;
+	}
+}
+
+// SPI NOR configuration flash with 256-byte pages, 4 KiB sectors and 64 KiB blocks
+class EmuFlash {
+	constructor(size=0x100000) {this.mem=Buffer.alloc(size, 0xff); this.wel=false; this.busy=0; this.buf=null;}
+
+	// Chip select at time t, commands are ignored while a program or erase is in progress
+	select(t) {this.buf=[]; this.ign=t<this.busy;}
+
+	// Transfer one byte at time t
+	xfer(b, t) {
+		const n=this.buf.push(b)-1;
+		const op=this.buf[0];
+		if(op==0x05 && n) return (t<this.busy?0x01:0x00)|(this.wel?0x02:0x00); // Read status
+		if(this.ign) return 0xff;
+		if(op==0x9f && n) return [0xef, 0x40, 0x14][n-1]??0xff; // JEDEC ID
+		if(op==0x03 && n>=4) return this.mem[((this.buf[1]<<16|this.buf[2]<<8|this.buf[3])+n-4)%this.mem.length]; // Read
+		return 0xff;
+	}
+
+	// Chip deselect at time t, executes write enable, program and erase
+	deselect(t) {
+		const [op, ...d]=this.buf||[];
+		this.buf=null;
+		if(op===undefined || this.ign) return;
+		const adr=(d[0]<<16|d[1]<<8|d[2])%this.mem.length;
+		if(op==0x06) this.wel=true;
+		else if(op==0x04) this.wel=false;
+		else if(this.wel && op==0x02 && d.length>3) {for(let i=3;i<d.length;i++) this.mem[adr&~0xff|(adr+i-3)&0xff]&=d[i]; this.busy=t+700; this.wel=false;} // Page program
+		else if(this.wel && op==0x20 && d.length>=3) {this.mem.fill(0xff, adr&~0xfff, (adr&~0xfff)+0x1000); this.busy=t+45000; this.wel=false;} // Sector erase
+		else if(this.wel && op==0xd8 && d.length>=3) {this.mem.fill(0xff, adr&~0xffff, (adr&~0xffff)+0x10000); this.busy=t+150000; this.wel=false;} // Block erase
+	}
+}
+
+// Emulated adapter, drop-in transport for UsbJtag.open
+class UsbEmu {
+	// link holds the fastest SPI divider and padding that the wiring carries, faster settings corrupt TDO
+	// exact models a JTAG_EXACT build, every kernel bit takes as long as the one that loads the next byte
+	constructor({slots=12, sn="", tap=new EmuTap, flash=new EmuFlash, link={div: 2, pad: 0}, exact=false}={}) {
+		this.slots=slots; this.tap=tap; this.flash=flash; this.link=link; this.exact=exact;
+		this.ctl=0x0f; this.rom=Buffer.alloc(19, 0xff); this.rom.fill(0, 1, 17); this.rom[0]=0x0f; this.rom.write(sn.slice(0, 16), 1); this.err=0;
+		this.rate(this.rom[17], this.rom[18]);
+		this.ret=[]; this.bat=false; this.stm={len: 0}; this.ncs=true; this.cap=null;
+		this.resp=[]; this.rxw=[]; this.txBusy=0;
+		this.t=0; this.bus=0; this.host=0; this.done=[]; this.inDone=[0, 0]; // Device, bus and host time
+		this.sta={cmd: [0, 0, 0, 0, 0], raw: 0, bits: 0, spi: 0, nak: 0, spin: 0, busy: 0}; // Firmware performance counters
+		this.st={outTransfers: 0, outPackets: 0, outBytes: 0, inPackets: 0, inBytes: 0, roundTrips: 0, ops: {}};
+		this.tap.power(this.flash.mem[0]!=0xff); this.pwr=[0, 0, 0]; this.pwrTmo=0;
+	}
+
+	// Counters and host time in us
+	stats() {return {...this.st, ops: {...this.st.ops}, time: this.host, clocks: this.tap.clocks};}
+
+	close() {}
+
+	// Bulk OUT transfer, an idle pipeline waits for the next frame
+	tx(buf) {
+		buf=Buffer.from(buf);
+		if(!this.txBusy) {this.host=Math.floor(this.host/FRAME+1)*FRAME; this.st.roundTrips++;}
+		this.txBusy++;
+		this.st.outTransfers++;
+		let end=this.host;
+		for(let i=0;i<buf.length;i+=64) end=this.packet(buf.subarray(i, i+64), this.host);
+		return new Promise((res)=> setImmediate(()=> {this.txBusy--; this.host=Math.max(this.host, end); res();}));
+	}
+
+	// Bulk IN transfer, times out 100 ms of virtual time after it is posted like the real endpoint
+	// With nothing queued for it the wall clock stands in, only a later OUT transfer can still answer it
+	rx(len) {
+		return new Promise((res, rej)=> {
+			const w={res, rej, t: this.host, tmo: null};
+			this.rxw.push(w);
+			this.pump();
+			if(this.rxw.includes(w)) w.tmo=setTimeout(()=> this.expire(w), 100);
+		});
+	}
+
+	// Time out a waiting read, host time moves to its deadline
+	expire(w) {
+		clearTimeout(w.tmo);
+		this.rxw.splice(this.rxw.indexOf(w), 1);
+		this.host=Math.max(this.host, w.t+100*FRAME);
+		w.rej(Object.assign(new Error("LIBUSB_TRANSFER_TIMED_OUT"), {errno: 2}));
+	}
+
+	// Hand queued IN packets to waiting reads, a capture makes packets as reads drain them
+	// A packet ready after the read's deadline stays queued for the next read
+	pump() {
+		for(;;) {
+			while(this.rxw.length && this.resp.length) {
+				const w=this.rxw[0], r=this.resp[0];
+				if(r.done>w.t+100*FRAME) {this.expire(w); continue;}
+				this.rxw.shift(); this.resp.shift();
+				clearTimeout(w.tmo);
+				this.host=Math.max(this.host, r.done);
+				w.res(r.data);
+			}
+			if(!this.cap || !this.rxw.length) return;
+			this.capStep();
+		}
+	}
+
+	// Packet on the wire, returns the time it ends
+	wire(t, len) {this.bus=Math.max(t, this.bus)+(len+OVH)*8/12; return this.bus;}
+
+	// Receive and process one EP1 packet, it is NAKed until one of the buffers is free
+	packet(pkt, t) {
+		const free=this.done.length>=this.slots?this.done[this.done.length-this.slots]:0;
+		if(free>Math.max(t, this.bus)) this.sta.nak++; // Ring full
+		const arr=this.wire(Math.max(t, free), pkt.length);
+		this.st.outPackets++; this.st.outBytes+=pkt.length;
+		this.t=Math.max(arr, this.done.length?this.done[this.done.length-1]:0);
+		if(this.cap) this.capEnd(); // Any OUT packet stops a capture
+		const t0=this.t;
+		this.cyc(COST.parse);
+		if(this.stm.len) {this.sta.raw++; this.stmWrite(pkt);}
+		else if(pkt[0]==0x04) {this.sta.cmd[4]++; this.batch(pkt);}
+		else this.parse(pkt);
+		this.sta.busy+=Math.round((this.t-t0)*CLK/12);
+		this.done.push(this.t);
+		if(this.done.length>this.slots) this.done.shift();
+		return arr;
+	}
+
+	cyc(n) {this.t+=n/CLK;}
+
+	// rate_set, unset or invalid settings fall back to 8 MHz and default padding
+	rate(div, pad) {[this.div, this.pad]=div>=2 && div<=64 && pad<=64?[div, pad]:[2, 1];}
+
+	// Bitbang cycles per bit with the padding in use
+	bitCyc(base) {return base-COST.pad+(this.pad?COST.pad+COST.padStep*(this.pad-1):0);}
+
+	// SPI cycles per byte, dividers above 2 poll S0_FREE through 8 slower SPI clocks
+	spiCyc(base) {return this.div>2?Math.max(base, COST.spiPut)+8*(this.div-2):base;}
+
+	// EP2 IN packet, ping-pong buffers so it only waits for the packet before the previous one to drain
+	flush() {this.queue(); this.pump();}
+
+	// Queue EP2 IN packet, zlp queues a zero-length packet
+	queue(zlp=false) {
+		if(!this.ret.length && !zlp) return;
+		if(this.t<this.inDone[0]) {this.sta.spin++; this.t=this.inDone[0];}
+		const data=Buffer.from(this.ret);
+		this.ret=[];
+		const done=this.wire(Math.max(this.t, this.inDone[1]), data.length);
+		this.inDone=[this.inDone[1], done];
+		this.st.inPackets++; this.st.inBytes+=data.length;
+		this.resp.push({data, done});
+	}
+
+	// usb_capture, usb_readback and usb_sectors loop, one packet of whole samples, count done queues the zero-length packet
+	capStep() {
+		const c=this.cap;
+		do {this.ret.push(...c.next()); c.left--;} while(c.left && this.ret.length+c.n<=64);
+		this.queue();
+		if(!c.left) this.capEnd();
+	}
+
+	// End capture with the partial packet and a zero-length packet
+	capEnd() {if(this.cap && this.cap.end) this.cap.end(); this.queue(); this.queue(true); this.cap=null;}
+
+	// Queue response bytes, usb_wait and usb_tx
+	reply(dat) {
+		if(this.ret.length+dat.length>64) this.flush();
+		this.ret.push(...dat);
+		if(!this.bat) this.flush();
+	}
+
+	// JTAG bitbang byte, LSB first, whole bytes of kernel k run the carry-rotate kernels at padding 0 and 1
+	jtagByte(tms, tdi, read, bits=8, k=null) {
+		let tdo=0;
+		for(let m=0;m<bits;m++) tdo|=this.tap.clock(tms>>m&1, tdi>>m&1)<<m;
+		this.sta.bits+=bits;
+		const p=this.pad?COST.pad:0;
+		if(k && this.pad<=1) this.cyc(this.exact?8*(k[0]+p+k[1]):8*(k[0]+p)+k[1]);
+		else this.cyc(this.bitCyc(read?COST.jtagRx:COST.jtagTx)*bits);
+		return read && this.pad<this.link.pad?tdo^1:tdo;
+	}
+
+	// JTAG TMS path, TDI low
+	jtagPath(tms, cnt) {for(let i=0;i<cnt;i++) this.tap.clock(tms>>i&1, 0); this.sta.bits+=cnt; this.cyc(this.bitCyc(COST.jtagPath)*cnt);}
+
+	// SPI byte, MSB first, JTAG holds TMS low
+	spiByte(b, jtag) {
+		let tdo=0;
+		this.sta.spi++;
+		if(jtag) for(let m=7;m>=0;m--) tdo|=this.tap.clock(0, b>>m&1)<<m;
+		else {if(this.ncs) {this.flash.select(this.t); this.ncs=false;} tdo=this.flash.xfer(b, this.t);}
+		return tdo;
+	}
+
+	// SPI release NCS
+	spiEnd() {if(!this.ncs) {this.flash.deselect(this.t); this.ncs=true;}}
+
+	// spi_write, mode bit 0 selects JTAG, bit 1 keeps NCS asserted
+	spiWrite(buf, mode) {
+		for(const b of buf) {this.spiByte(b, mode&0x01); this.cyc(this.spiCyc(COST.spiTx));}
+		if(!mode) this.spiEnd();
+	}
+
+	// spi_write_read
+	spiWriteRead(buf, jtag) {
+		const ret=Array.from(buf, (b)=> {this.cyc(this.spiCyc(COST.spiRx)); return this.spiByte(b, jtag)^(this.div<this.link.div?0x01:0x00);});
+		if(!jtag) this.spiEnd();
+		return ret;
+	}
+
+	// spi_read, 0xff TX with NCS held low
+	spiRead(n) {return Array.from({length: n}, ()=> {this.cyc(this.spiCyc(COST.spiFf)); return this.spiByte(0xff, 0)^(this.div<this.link.div?0x01:0x00);});}
+
+	// spi_crc, flash read command then CRC-16/CCITT of len bytes
+	spiCrc(adr, len) {
+		this.cyc(COST.crcSector);
+		for(const b of [0x03, adr>>16&0xff, adr>>8&0xff, adr&0xff]) this.spiByte(b, 0);
+		let crc=0xffff;
+		for(let i=0;i<len;i++) {this.cyc(this.spiCyc(COST.crc)); crc=UsbEmu.crc16([this.spiByte(0xff, 0)^(this.div<this.link.div?0x01:0x00)], crc);}
+		this.spiEnd();
+		return crc;
+	}
+
+	// spi_wait, polls WIP back to back until it clears or ms pass on timer 0, returns 1 on timeout
+	spiWait(ms) {
+		const p=this.spiCyc(COST.spiPut)/CLK;
+		this.spiEnd();
+		this.spiByte(0x05, 0); this.cyc(this.spiCyc(COST.spiPut));
+		this.t+=Math.max(0, Math.ceil((Math.min(this.flash.busy, this.t+ms*1000)-this.t)/p))*p; // Polls until the one that sees WIP clear or the timer expire
+		const st=this.spiByte(0xff, 0); this.cyc(this.spiCyc(COST.spiPut));
+		this.spiEnd();
+		return st&0x01;
+	}
+
+	// jtag_scan
+	jtagScan(buf, read) {
+		const ent=buf[0]>>4, tms=buf[2];
+		let ext=buf[0]&0x0f, len=buf.length;
+		if(len<4 || ent>8 || ext>8) return null;
+		len-=4;
+		if(len && (buf[3]<1 || buf[3]>8)) return null;
+		this.jtagPath(buf[1], ent);
+		const ret=[];
+		for(let i=0;i<len;i++) {
+			const bits=i==len-1?buf[3]:8;
+			const last=i==len-1 && ext?(tms&0x01)<<(bits-1):0;
+			ret.push(this.jtagByte(last, buf[4+i], read, bits, i<len-1?(read?COST.kern.lrx:COST.kern.ltx):null));
+		}
+		if(len && ext) {ext--; this.jtagPath(tms>>1, ext);}
+		else this.jtagPath(tms, ext);
+		return ret;
+	}
+
+	// stm_write
+	stmWrite(buf) {
+		const s=this.stm;
+		buf=buf.subarray(0, Math.min(buf.length, s.len));
+		s.len-=buf.length;
+		this.cyc(COST.stream);
+		if(s.snk==0x03) return this.stmVerify(buf);
+		if(s.snk==0x04) return this.stmExpand(buf);
+		if(s.snk<0x02) return this.spiWrite(buf, s.snk?0x01:(s.len?0x02:0x00));
+		for(let i=0;i<buf.length;) { // Split at page boundaries and wait for each page program
+			if(!s.pg) {this.spiEnd(); this.spiWrite([0x06], 0); this.spiWrite([0x02, s.adr>>16&0xff, s.adr>>8&0xff, s.adr&0xff], 0x02); s.pg=true;}
+			const n=Math.min(buf.length-i, 256-(s.adr&0xff));
+			this.spiWrite(buf.subarray(i, i+n), 0x02); i+=n; s.adr+=n;
+			if(!(s.adr&0xff) || (!s.len && i==buf.length)) {this.spiEnd(); s.pg=false; if(this.spiWait(20)) this.err=1;}
+		}
+	}
+
+	// stm_expand, tokens never cross packets
+	stmExpand(buf) {
+		for(let i=0;i<buf.length;) {
+			const t=buf[i++];
+			let cnt;
+			this.cyc(COST.rleToken);
+			if(t<0x80) {const n=Math.min(t+1, buf.length-i); this.spiWrite(buf.subarray(i, i+n), 0x01); i+=n; continue;}
+			if(t==0xff) {if(buf.length-i<3) break; cnt=buf.readUInt16LE(i); i+=2;}
+			else {if(i>=buf.length) break; cnt=t-0x7e;}
+			const v=buf[i++];
+			for(let k=0;k<cnt;k++) this.spiByte(v, 1);
+			this.cyc(this.spiCyc(COST.spiFill)*cnt);
+		}
+	}
+
+	// stm_verify
+	stmVerify(buf) {
+		const s=this.stm;
+		for(const b of buf) {
+			if(!s.fld) {s.fld=s.mod&0x0e; s.tdi=0xff; s.msk=0xff;}
+			if(s.fld&0x02) {s.tdi=b; s.fld&=~0x02;}
+			else if(s.fld&0x04) {s.exp=b; s.fld&=~0x04;}
+			else {s.msk=b; s.fld=0;}
+			this.cyc(COST.verify);
+			if(s.fld) continue;
+			if(this.div>2) this.cyc(8*(this.div-2)); // Slower SPI clock
+			const tdo=this.spiByte(s.tdi, s.mod&0x01);
+			s.crc=UsbEmu.crc16([tdo], s.crc);
+			if(s.mod&0x04 && (tdo^s.exp)&s.msk && s.bad==0xffffffff) s.bad=s.cnt;
+			s.cnt++;
+		}
+		if(!s.len && !(s.mod&0x01)) this.spiEnd();
+	}
+
+	// CRC-16/CCITT
+	static crc16(buf, crc=0xffff) {
+		for(const b of buf) {let x=(crc>>8^b)&0xff; x^=x>>4; crc=(crc<<8^x<<12^x<<5^x)&0xffff;}
+		return crc;
+	}
+
+	// Power sequencing like ctl_write, off and on phases as the firmware polls them, or a configuration reload
+	// Each phase ends on the first poll past its modelled time or its timeout, Vbus without a rail load to shed settles on the first stable run
+	power(off, on, was=true) {
+		const done=this.flash.mem[0]!=0xff;
+		const poll=(k, us, step)=> {if(us<PWR.tmo[k]) return Math.ceil(us/step)*step; this.pwrTmo|=1<<k; return Math.ceil(PWR.tmo[k]/step)*step;};
+		this.pwr=[0, 0, 0]; this.pwrTmo=0;
+		if(off) {this.cyc(COST.pmu*2); this.pwr[0]=poll(0, (was?PWR.off:0)+(PWR.stable-1)*PWR.adcPoll, PWR.adcPoll); if(!(this.pwrTmo&0x01)) this.pwr[0]+=PWR.hold;}
+		if(on) {this.cyc(COST.pmu); this.pwr[1]=poll(1, PWR.rail+(PWR.stable-1)*PWR.adcPoll, PWR.adcPoll);}
+		else if(!off) {this.cyc(COST.pmu); this.t+=250;}
+		if(on || !off) {this.cyc(COST.pmu); this.pwr[2]=poll(2, done?this.tap.boot:PWR.blank, PWR.jtagPoll); this.tap.power(done);}
+		this.t+=this.pwr[0]+this.pwr[1]+this.pwr[2];
+	}
+
+	// Hard reset FPGA, reloads from flash
+	reset() {this.power(false, false);}
+
+	// usb_parse, sets error status like the firmware
+	parse(buf) {
+		if(buf.length<2) return;
+		const cmd=buf[0], arg=buf[1], dat=buf.subarray(2), len=dat.length;
+		const key=cmd.toString(16).padStart(2, "0")+" "+arg.toString(16).padStart(2, "0");
+		this.st.ops[key]=(this.st.ops[key]||0)+1;
+		let err=1;
+		if(cmd<5) this.sta.cmd[cmd]++;
+		if(cmd==0x00) {
+			if(arg==0x00 && len==1 && dat[0]<=0x01) {if(this.ctl&0x01) {if(dat[0]) this.t+=250; else this.reset();} err=0;}
+			else if(arg==0x01 && len==1 && dat[0]<=0x01) {this.reply([dat[0]?this.rom[0]:this.ctl]); err=0;}
+			else if(arg==0x02 && len==2 && dat[0]<=0x01) {
+				if(dat[0]) this.rom[0]=dat[1];
+				else if(!(this.ctl&0x80)) {const old=this.ctl; this.ctl=dat[1]; if((old^this.ctl)&0x01) this.power(true, this.ctl&0x01, old&0x01);}
+				err=0;
+			}
+			else if(arg==0x03 && len==0) {this.cyc(COST.pmu*2); this.reply([194]); err=0;}
+			else if(arg==0x04 && len==3) {this.t+=dat[1]*FRAME+dat[2]; err=0;}
+			else if(arg==0x05 && len==0) {this.reply([this.err]); err=0;}
+			else if(arg==0x09 && len==0) {const r=Buffer.alloc(13); this.pwr.forEach((x, i)=> r.writeUInt32LE(x, i*4)); r[12]=this.pwrTmo; this.reply(r); err=0;}
+			else if(arg==0x06 && len<=1) {
+				const r=Buffer.alloc(44), v=[...this.sta.cmd, this.sta.raw, this.sta.bits, this.sta.spi, this.sta.nak, this.sta.spin, this.sta.busy];
+				v.forEach((x, i)=> r.writeUInt32LE(x>>>0, i*4));
+				this.reply(r);
+				if(len && dat[0]) this.sta={cmd: [0, 0, 0, 0, 0], raw: 0, bits: 0, spi: 0, nak: 0, spin: 0, busy: 0};
+				err=0;
+			}
+			else if(arg==0x07 && len==1 && dat[0]<=0x01) {this.reply(dat[0]?this.rom.subarray(17, 19):[this.div, this.pad]); err=0;}
+			else if(arg==0x08 && len==3 && dat[0]<=0x01 && dat[1]>=2 && dat[1]<=64 && dat[2]<=64) {if(dat[0]) dat.copy(this.rom, 17, 1, 3); else this.rate(dat[1], dat[2]); err=0;}
+			else if(arg==0xfd && len==0) {this.reply(this.rom.subarray(1, 17)); err=0;}
+			else if(arg==0xfe && len<=16) {this.rom.fill(0, 1, 17); dat.copy(this.rom, 1); err=0;}
+			else if(arg==0xff && len==0) err=0;
+		}
+		else if(cmd==0x01 && len) {
+			if(arg==0x00 && !(len&1)) {for(let i=0;i<len>>1;i++) this.jtagByte(dat[i], dat[i+(len>>1)], false, 8, COST.kern.tx); err=0;}
+			else if(arg==0x01 && !(len&1)) {this.reply(Array.from(dat.subarray(0, len>>1), (m, i)=> {if(this.pad<=1) this.cyc(COST.kernCopy); return this.jtagByte(m, dat[i+(len>>1)], true, 8, COST.kern.rx);})); err=0;}
+			else if(arg==0x02) {this.spiWrite(dat, 0x01); err=0;}
+			else if(arg==0x03) {this.reply(this.spiWriteRead(dat, 1)); err=0;}
+			else if(arg==0x04) err=this.jtagScan(dat, false)?0:1;
+			else if(arg==0x05 && len>4) {const r=this.jtagScan(dat, true); if(r) {this.reply(r); err=0;}}
+		}
+		else if(cmd==0x02 && len) {
+			if(arg==0x00) {this.spiWrite(dat, 0x00); err=0;}
+			else if(arg==0x01) {this.reply(this.spiWriteRead(dat, 0)); err=0;}
+			else if(arg==0x02 && len==2) err=this.spiWait(dat.readUInt16LE(0));
+		}
+		else if(cmd==0x03) {
+			if((arg<=0x01 || arg==0x04) && len>=4) {this.stm={snk: arg, len: dat.readUInt32LE(0)}; this.stmWrite(dat.subarray(4)); err=0;}
+			else if(arg==0x02 && len>=8) {this.stm={snk: arg, len: dat.readUInt32LE(0), adr: dat.readUInt32LE(4), pg: false}; this.stmWrite(dat.subarray(8)); return;} // Error status is kept
+			else if(arg==0x03 && len>=6 && len>=6+dat[5] && dat[4]&0x06 && (dat[4]&0x0c)!=0x08) {
+				this.stm={snk: arg, len: dat.readUInt32LE(0), mod: dat[4], fld: 0, crc: 0xffff, cnt: 0, bad: 0xffffffff};
+				this.spiWrite(dat.subarray(6, 6+dat[5]), dat[4]&0x01?0x01:0x02);
+				this.stmWrite(dat.subarray(6+dat[5])); err=0;
+			}
+			else if((arg==0x81 || arg==0x82) && len>4 && !this.bat && (arg==0x82 || len>=9) && len-(arg==0x81?8:4)<=64) {
+				const d=Buffer.from(dat.subarray(4));
+				if(arg==0x81 && (d[0]>>4>8 || (d[0]&0x0f)>8 || d[3]<1 || d[3]>8)) this.capEnd(); // Invalid scan, the firmware fails on the first sample
+				else {this.cap={next: arg==0x81?()=> this.jtagScan(d, true):()=> this.spiWriteRead(d, 0), n: arg==0x81?d.length-4:d.length, left: dat.readUInt32LE(0)||Infinity}; err=0;}
+			}
+			else if(arg==0x84 && len>4 && !this.bat) { // Readback in packets of 64 bytes, the last one short
+				let left=dat.readUInt32LE(0);
+				this.spiWrite(dat.subarray(4), 0x02);
+				this.cap={next: ()=> {const k=Math.min(64, left); left-=k; return this.spiRead(k);}, n: 64, left: Math.ceil(left/64), end: ()=> this.spiEnd()};
+				if(!this.cap.left) this.capEnd();
+				err=0;
+			}
+			else if(arg==0x85 && len==7 && !this.bat && dat[6]>=8 && dat[6]<=16) {
+				let adr=dat.readUInt32LE(0);
+				const size=1<<dat[6];
+				this.cap={next: ()=> {const c=this.spiCrc(adr, size); adr+=size; return [c&0xff, c>>8];}, n: 2, left: dat.readUInt16LE(4)};
+				if(!this.cap.left) this.capEnd();
+				err=0;
+			}
+			else if(arg==0x83 && len==0) err=0;
+			else if(arg==0x80 && len==0) {const r=Buffer.alloc(6); r.writeUInt16LE(this.stm.crc??0, 0); r.writeUInt32LE(this.stm.bad??0, 2); this.reply(r); err=0;}
+		}
+		this.err=err;
+	}
+
+	// usb_batch
+	batch(buf) {
+		if(buf.length<2 || buf[1]!=0x00) {this.err=1; return;}
+		this.bat=true;
+		for(let i=2, n;i<buf.length;i+=n+1) {n=buf[i]; if(n<2 || i+n>=buf.length) {this.err=1; break;} this.parse(buf.subarray(i+1, i+1+n));}
+		this.bat=false;
+		this.flush();
+	}
+}
+
+module.exports={UsbEmu, EmuTap, EmuFlash, COST, PWR};
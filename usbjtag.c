@@ -43,6 +43,32 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // #define SCL P15
 // #define SDA P16
 
+// EP1 OUT ring slots, 64 bytes each from 0x0100 to the end of XRAM
+#ifndef EP1_SLOTS
+#define EP1_SLOTS 12
+#endif
+#if EP1_SLOTS<2 || EP1_SLOTS>12
+#error "EP1_SLOTS must be 2 to 12"
+#endif
+
+// Cycle-exact bitbang, every bit of a whole-byte run takes as long as the one that loads the next byte
+#ifndef JTAG_EXACT
+#define JTAG_EXACT 0
+#endif
+
+// SLG46580 I2C half period in udelay units, 1 runs near fast mode 400 kHz, 5 is standard mode
+#ifndef I2C_US
+#define I2C_US 1
+#endif
+
+// Power sequencing timeouts in ms, Vbus settled after power off and after power on, configuration done, then the power-off hold
+#define PWR_OFF_MS 10
+#define PWR_RAIL_MS 5
+#define PWR_CFG_MS 200
+#define PWR_HOLD_MS 1
+#define PWR_VBUS 170 // Vbus floor in ADC counts, 4.4V
+#define PWR_STABLE 4 // Consecutive Vbus samples within 1 count
+
 // Helper macros
 #define pin_mode(p, n, m, v) {p##_MOD_OC=(m==0 || m==1)?p##_MOD_OC&~(1<<n):p##_MOD_OC|(1<<n); p##_DIR_PU=(m==0 || m==2)?p##_DIR_PU&~(1<<n):p##_DIR_PU|(1<<n); p##n=v;}
 #define pmu_byte (((ctl_byte&0x01)?0x03:0x00)|((ctl_byte&0x02)?0x04:0x00))
@@ -52,15 +78,62 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define spi_tx8 {spi_tx spi_tx spi_tx spi_tx spi_tx spi_tx spi_tx spi_tx}
 #define spi_rx {XBUS_AUX=0x04; spi_tx XBUS_AUX=0x05; __asm__("mov a, _SPI0_DATA"); __asm__("movx @dptr, a");}
 #define spi_rx8 {spi_rx spi_rx spi_rx spi_rx spi_rx spi_rx spi_rx spi_rx}
-#define jtag_txb(m) {TMS=tms&m; TDI=tdi&m; SAFE_MOD++; TCK=1; SAFE_MOD++; TCK=0;}
-#define jtag_tx {jtag_txb(0x01) jtag_txb(0x02) jtag_txb(0x04) jtag_txb(0x08) jtag_txb(0x10) jtag_txb(0x20) jtag_txb(0x40) jtag_txb(0x80)}
-#define jtag_rxb(m) {TMS=tms&m; TDI=tdi&m; SAFE_MOD++; tdo|=TDO?m:0; TCK=1; SAFE_MOD++; TCK=0;}
-#define jtag_rx {jtag_rxb(0x01) jtag_rxb(0x02) jtag_rxb(0x04) jtag_rxb(0x08) jtag_rxb(0x10) jtag_rxb(0x20) jtag_rxb(0x40) jtag_rxb(0x80)}
+#define spi_put(v) {SPI0_DATA=v; while(!S0_FREE);}
+#define spi_ff {__asm__("mov _SPI0_DATA, #0xff"); nops nop nop __asm__("mov a, _SPI0_DATA"); __asm__("movx @dptr, a");} // Read with 0xff TX into DPTR 0
+#define spi_ff8 {spi_ff spi_ff spi_ff spi_ff spi_ff spi_ff spi_ff spi_ff}
+#define jtag_pad0 // No padding, TCK edges back to back
+#define jtag_padn jtag_delay(); // Padding of a call plus jtag_pad-1 steps
+#define jtag_padx {if(jtag_pad) jtag_delay();} // Any padding, per-bit paths
+#define jtag_txb(m, p) {TMS=tms&m; TDI=tdi&m; p TCK=1; p TCK=0;}
+#define jtag_tx(p) {jtag_txb(0x01, p) jtag_txb(0x02, p) jtag_txb(0x04, p) jtag_txb(0x08, p) jtag_txb(0x10, p) jtag_txb(0x20, p) jtag_txb(0x40, p) jtag_txb(0x80, p)}
+#define jtag_rxb(m, p) {TMS=tms&m; TDI=tdi&m; p tdo|=TDO?m:0; TCK=1; p TCK=0;}
+#define jtag_rx(p) {jtag_rxb(0x01, p) jtag_rxb(0x02, p) jtag_rxb(0x04, p) jtag_rxb(0x08, p) jtag_rxb(0x10, p) jtag_rxb(0x20, p) jtag_rxb(0x40, p) jtag_rxb(0x80, p)}
+#define jtag_wr(p) for(i=0;i<len;i++) {tms=mbuf[i]; tdi=obuf[i]; jtag_tx(p)}
+#define jtag_wrr(p) for(i=0;i<len;i++) {tms=mbuf[i]; tdi=obuf[i]; tdo=0; jtag_rx(p) ibuf[i]=tdo;}
+#define jtag_wb(p) for(i=1;i<len;i++) {tdi=*obuf++; jtag_tx(p)}
+#define jtag_wrb(p) for(i=1;i<len;i++) {tdi=*obuf++; tdo=0; jtag_rx(p) *ibuf++=tdo;}
+#define jtag_pad1 __asm__("inc _SAFE_MOD"); // Default padding
+#define jtag_ks {__asm__("xch a, b"); __asm__("rrc a"); __asm__("mov _P30, c"); __asm__("xch a, b");} // TMS bit rotated out of B
+#define jtag_kt {__asm__("rrc a"); __asm__("mov _P15, c");} // TDI bit rotated out of A
+#define jtag_kr {__asm__("mov c, _P16"); __asm__("rrc a"); __asm__("mov _P15, c");} // TDO bit rotated into A as the TDI bit leaves
+#define jtag_kb(d, p, h) {__asm__("clr _P17"); d p __asm__("setb _P17"); h p} // One bit, TCK falls first and h runs while it is high
+#define jtag_kern(n, d, p, f, l) {__asm__(#n "$:"); jtag_kb(d, p, f) jtag_kb(d, p, f) jtag_kb(d, p, f) jtag_kb(d, p, f) jtag_kb(d, p, f) jtag_kb(d, p, f) jtag_kb(d, p, f) jtag_kb(d, p, l) __asm__("djnz _jtag_cnt, " #n "$"); __asm__("clr _P17");} // jtag_cnt bytes, the last bit loads the next one
+#define jtag_lw {__asm__("mov _XBUS_AUX, #0x04"); __asm__("movx a, @dptr"); __asm__("mov b, a"); __asm__("mov _XBUS_AUX, #0x05"); __asm__("movx a, @dptr");} // TMS from DPTR0, TDI from DPTR1
+#define jtag_lr {__asm__("mov _XBUS_AUX, #0x04"); __asm__("movx a, @dptr"); __asm__("mov b, a"); __asm__("mov _XBUS_AUX, #0x01"); __asm__("movx a, @dptr");} // As jtag_lw, DPTR1 holds until TDO is stored
+#define jtag_lrs {__asm__("mov _XBUS_AUX, #0x05"); __asm__("movx @dptr, a"); jtag_lr} // TDO over the TDI byte, then the next bytes
+#define jtag_ll __asm__("movx a, @dptr"); // TDI from DPTR0, TMS held low
+#define jtag_llr {__asm__("mov _XBUS_AUX, #0x05"); __asm__("movx @dptr, a"); __asm__("mov _XBUS_AUX, #0x04"); __asm__("movx a, @dptr");} // TDO to DPTR1, TDI from DPTR0
+#if JTAG_EXACT
+#define jtag_fw nops // Cycles of jtag_lw and a taken DJNZ
+#define jtag_fr {nops nop nop nop nop} // jtag_lrs and DJNZ
+#define jtag_fl {nop nop nop nop nop} // jtag_ll and DJNZ
+#define jtag_flr {nop nop nop nop nop nop nop nop nop nop nop nop} // jtag_llr and DJNZ
+#else
+#define jtag_fw
+#define jtag_fr
+#define jtag_fl
+#define jtag_flr
+#endif
+#define jtag_kw(n, p) jtag_kern(n, jtag_ks jtag_kt, p, jtag_fw, jtag_lw)
+#define jtag_kwr(n, p) jtag_kern(n, jtag_ks jtag_kr, p, jtag_fr, jtag_lrs)
+#define jtag_kl(n, p) jtag_kern(n, jtag_kt, p, jtag_fl, jtag_ll)
+#define jtag_klr(n, p) jtag_kern(n, jtag_kr, p, jtag_flr, jtag_llr)
+#define jtag_padk(k, c, d) {if(jtag_pad>1) {c(jtag_padn)} else {if(!jtag_pad) {d k(00001, jtag_pad0)} else {d k(00002, jtag_pad1)} XBUS_AUX=0x00;}} // Kernels for padding 0 and 1 after d loads DPTRs and the first bytes, byte loops beyond
+#define rate_ok(d, p) ((d)>=2 && (d)<=64 && (p)<=64)
 #define usb_txdesc(d) {len=sizeof(d); len=len>*slen?*slen:len; for(i=0;i<len;i++) buf_ep0[i]=d[i];}
 #define usb_txstr(d) {usb_txdesc(d); if(buf_ep0[0]>len) buf_ep0[0]=len;}
-#define usb_tx(l) {UEP2_T_LEN=l; UEP2_CTRL&=~0x02;}
-#define usb_ret(v) {while(UEP2_T_LEN); buf_ep2[0]=v; usb_tx(1)}
-#define i2c_tx(b) {for(i=8;i>0;) {SDA=b&(1<<--i); udelay(5); SCL=1; udelay(5); SCL=0;} SDA=1; udelay(5); SCL=1; udelay(5); SCL=0;}
+#define usb_flush {EA=0; if(ep2_busy) {len_ep2=ret_len; ep2_pend=1;} else {UEP2_DMA=(uint16_t)buf_ep2[idx_w_ep2]; UEP2_T_LEN=ret_len; UEP2_CTRL&=~0x02; ep2_busy=1;} idx_w_ep2^=1; EA=1; ret_len=0;}
+#define usb_wait(l) {if(ret_len+(l)>64) usb_flush if(!ret_len && ep2_pend) {sta.spin++; while(ep2_pend);}}
+#define usb_buf (buf_ep2[idx_w_ep2]+ret_len)
+#define usb_tx(l) {ret_len+=l; if(!ret_bat) usb_flush}
+#define usb_ret(v) {usb_wait(1) *usb_buf=v; usb_tx(1)}
+#define usb_stop (len_ep1[nxt] || stm_abt) // Pushed sequences stop on the next OUT packet or an abort request
+#define usb_hold(l) {if(ret_len+(l)>64) usb_flush while(!ret_len && ep2_pend && !usb_stop);} // usb_wait for pushed sequences, gives up once they stop
+#define i2c_tx(b) {for(i=8;i>0;) {SDA=b&(1<<--i); udelay(I2C_US); SCL=1; udelay(I2C_US); SCL=0;} SDA=1; udelay(I2C_US); SCL=1; udelay(I2C_US); SCL=0;}
+#define tmr_ms(m) ((uint32_t)(m)*4000/3) // Timer ticks in ms
+#define tmr_us(t) ((t)*3>>2) // Timer ticks to us
+#define fpga_on(s) ((s)!=0x00000000 && (s)!=0xffffffff) // TAP answers status reads
+#define fpga_rdy(s) (fpga_on(s) && ((s)&0x2000 || ((s)&0x8000 && !((s)&0x0400)))) // Done final, or ready with no configuration in progress
 
 // USB descriptors
 __code uint8_t desc_dev[]={0x12, 0x01, 0x00, 0x02, 0xff, 0xff, 0xff, 0x40, // USB2.0, vendor device, 64 bytes
@@ -74,30 +147,153 @@ __code uint8_t desc_lng[]={0x04, 0x03, 0x09, 0x04}; // en-US
 __code uint8_t desc_ven[]={0x12, 0x03, 'B', 0, 'o', 0, '\'', 0, 's', 0, ' ', 0, 'L', 0, 'a', 0, 'b', 0};
 __code uint8_t desc_pro[]={0x12, 0x03, 'U', 0, 'S', 0, 'B', 0, '-', 0, 'J', 0, 'T', 0, 'A', 0, 'G', 0};
 
+// CRC-16/CCITT table split into high and low bytes, one lookup each per byte for flash sector CRCs
+__code uint8_t crc_hi[256]={
+	0x00, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x81, 0x91, 0xa1, 0xb1, 0xc1, 0xd1, 0xe1, 0xf1,
+	0x12, 0x02, 0x32, 0x22, 0x52, 0x42, 0x72, 0x62, 0x93, 0x83, 0xb3, 0xa3, 0xd3, 0xc3, 0xf3, 0xe3,
+	0x24, 0x34, 0x04, 0x14, 0x64, 0x74, 0x44, 0x54, 0xa5, 0xb5, 0x85, 0x95, 0xe5, 0xf5, 0xc5, 0xd5,
+	0x36, 0x26, 0x16, 0x06, 0x76, 0x66, 0x56, 0x46, 0xb7, 0xa7, 0x97, 0x87, 0xf7, 0xe7, 0xd7, 0xc7,
+	0x48, 0x58, 0x68, 0x78, 0x08, 0x18, 0x28, 0x38, 0xc9, 0xd9, 0xe9, 0xf9, 0x89, 0x99, 0xa9, 0xb9,
+	0x5a, 0x4a, 0x7a, 0x6a, 0x1a, 0x0a, 0x3a, 0x2a, 0xdb, 0xcb, 0xfb, 0xeb, 0x9b, 0x8b, 0xbb, 0xab,
+	0x6c, 0x7c, 0x4c, 0x5c, 0x2c, 0x3c, 0x0c, 0x1c, 0xed, 0xfd, 0xcd, 0xdd, 0xad, 0xbd, 0x8d, 0x9d,
+	0x7e, 0x6e, 0x5e, 0x4e, 0x3e, 0x2e, 0x1e, 0x0e, 0xff, 0xef, 0xdf, 0xcf, 0xbf, 0xaf, 0x9f, 0x8f,
+	0x91, 0x81, 0xb1, 0xa1, 0xd1, 0xc1, 0xf1, 0xe1, 0x10, 0x00, 0x30, 0x20, 0x50, 0x40, 0x70, 0x60,
+	0x83, 0x93, 0xa3, 0xb3, 0xc3, 0xd3, 0xe3, 0xf3, 0x02, 0x12, 0x22, 0x32, 0x42, 0x52, 0x62, 0x72,
+	0xb5, 0xa5, 0x95, 0x85, 0xf5, 0xe5, 0xd5, 0xc5, 0x34, 0x24, 0x14, 0x04, 0x74, 0x64, 0x54, 0x44,
+	0xa7, 0xb7, 0x87, 0x97, 0xe7, 0xf7, 0xc7, 0xd7, 0x26, 0x36, 0x06, 0x16, 0x66, 0x76, 0x46, 0x56,
+	0xd9, 0xc9, 0xf9, 0xe9, 0x99, 0x89, 0xb9, 0xa9, 0x58, 0x48, 0x78, 0x68, 0x18, 0x08, 0x38, 0x28,
+	0xcb, 0xdb, 0xeb, 0xfb, 0x8b, 0x9b, 0xab, 0xbb, 0x4a, 0x5a, 0x6a, 0x7a, 0x0a, 0x1a, 0x2a, 0x3a,
+	0xfd, 0xed, 0xdd, 0xcd, 0xbd, 0xad, 0x9d, 0x8d, 0x7c, 0x6c, 0x5c, 0x4c, 0x3c, 0x2c, 0x1c, 0x0c,
+	0xef, 0xff, 0xcf, 0xdf, 0xaf, 0xbf, 0x8f, 0x9f, 0x6e, 0x7e, 0x4e, 0x5e, 0x2e, 0x3e, 0x0e, 0x1e};
+__code uint8_t crc_lo[256]={
+	0x00, 0x21, 0x42, 0x63, 0x84, 0xa5, 0xc6, 0xe7, 0x08, 0x29, 0x4a, 0x6b, 0x8c, 0xad, 0xce, 0xef,
+	0x31, 0x10, 0x73, 0x52, 0xb5, 0x94, 0xf7, 0xd6, 0x39, 0x18, 0x7b, 0x5a, 0xbd, 0x9c, 0xff, 0xde,
+	0x62, 0x43, 0x20, 0x01, 0xe6, 0xc7, 0xa4, 0x85, 0x6a, 0x4b, 0x28, 0x09, 0xee, 0xcf, 0xac, 0x8d,
+	0x53, 0x72, 0x11, 0x30, 0xd7, 0xf6, 0x95, 0xb4, 0x5b, 0x7a, 0x19, 0x38, 0xdf, 0xfe, 0x9d, 0xbc,
+	0xc4, 0xe5, 0x86, 0xa7, 0x40, 0x61, 0x02, 0x23, 0xcc, 0xed, 0x8e, 0xaf, 0x48, 0x69, 0x0a, 0x2b,
+	0xf5, 0xd4, 0xb7, 0x96, 0x71, 0x50, 0x33, 0x12, 0xfd, 0xdc, 0xbf, 0x9e, 0x79, 0x58, 0x3b, 0x1a,
+	0xa6, 0x87, 0xe4, 0xc5, 0x22, 0x03, 0x60, 0x41, 0xae, 0x8f, 0xec, 0xcd, 0x2a, 0x0b, 0x68, 0x49,
+	0x97, 0xb6, 0xd5, 0xf4, 0x13, 0x32, 0x51, 0x70, 0x9f, 0xbe, 0xdd, 0xfc, 0x1b, 0x3a, 0x59, 0x78,
+	0x88, 0xa9, 0xca, 0xeb, 0x0c, 0x2d, 0x4e, 0x6f, 0x80, 0xa1, 0xc2, 0xe3, 0x04, 0x25, 0x46, 0x67,
+	0xb9, 0x98, 0xfb, 0xda, 0x3d, 0x1c, 0x7f, 0x5e, 0xb1, 0x90, 0xf3, 0xd2, 0x35, 0x14, 0x77, 0x56,
+	0xea, 0xcb, 0xa8, 0x89, 0x6e, 0x4f, 0x2c, 0x0d, 0xe2, 0xc3, 0xa0, 0x81, 0x66, 0x47, 0x24, 0x05,
+	0xdb, 0xfa, 0x99, 0xb8, 0x5f, 0x7e, 0x1d, 0x3c, 0xd3, 0xf2, 0x91, 0xb0, 0x57, 0x76, 0x15, 0x34,
+	0x4c, 0x6d, 0x0e, 0x2f, 0xc8, 0xe9, 0x8a, 0xab, 0x44, 0x65, 0x06, 0x27, 0xc0, 0xe1, 0x82, 0xa3,
+	0x7d, 0x5c, 0x3f, 0x1e, 0xf9, 0xd8, 0xbb, 0x9a, 0x75, 0x54, 0x37, 0x16, 0xf1, 0xd0, 0xb3, 0x92,
+	0x2e, 0x0f, 0x6c, 0x4d, 0xaa, 0x8b, 0xe8, 0xc9, 0x26, 0x07, 0x64, 0x45, 0xa2, 0x83, 0xe0, 0xc1,
+	0x1f, 0x3e, 0x5d, 0x7c, 0x9b, 0xba, 0xd9, 0xf8, 0x17, 0x36, 0x55, 0x74, 0x93, 0xb2, 0xd1, 0xf0};
+
 // Endpoint buffers
 __xdata __at (0x0000) uint8_t buf_ep0[64];
-__xdata __at (0x0080) uint8_t buf_ep1[2][64];
-__xdata __at (0x0040) uint8_t buf_ep2[64];
-uint8_t len_ep1[2], idx_r_ep1;
-#define buf_ep1_r buf_ep1[idx_r_ep1]
-#define buf_ep1_w buf_ep1[1-idx_r_ep1]
-#define len_ep1_r len_ep1[idx_r_ep1]
-#define len_ep1_w len_ep1[1-idx_r_ep1]
+__xdata __at (0x0040) uint8_t buf_ep2[2][64]; // EP2 IN ping-pong, one on the wire while the other fills
+__xdata __at (0x0100) uint8_t buf_ep1[EP1_SLOTS][64]; // EP1 OUT ring in XRAM above the counters
+__idata uint8_t len_ep1[EP1_SLOTS], idx_r_ep1, idx_w_ep1; // Slot lengths, zero when free, main loop reads and USB DMA writes
+uint32_t stm_len; // Stream bytes left
+uint32_t stm_adr; // Stream flash address
+uint8_t stm_abt; // Abort requested on EP0, the main loop drops stream state and queued packets
+uint8_t stm_snk, stm_pg; // Stream sink, 0x00 SPI, 0x01 JTAG, 0x02 SPI flash program, 0x03 verify, 0x04 JTAG compressed, and flash page open
+uint8_t stm_mod, stm_fld, stm_tdi, stm_exp, stm_msk; // Verify mode, record fields left, and current record
+uint16_t stm_crc; // Verify TDO CRC
+uint32_t stm_cnt, stm_bad; // Verify TDO bytes and first mismatch offset
+uint8_t ret_len, ret_bat; // EP2 IN bytes pending, batch in progress
+uint8_t idx_w_ep2, len_ep2, ep2_busy, ep2_pend; // EP2 IN buffer being filled, queued length, transfer armed, second packet queued
+uint8_t usb_err; // Error status of last command
+uint8_t spi_div, jtag_pad; // SPI clock divider of Fsys, bitbang padding, 0 none, 1 default, 2-64 jtag_delay steps
+uint8_t jtag_cnt; // Bitbang kernel bytes left
+__xdata __at (0x00c0) struct {uint32_t cmd[5], raw, bits, spi, nak, spin, busy;} sta; // Performance counters, commands per opcode, stream packets, bitbang bits, SPI bytes, EP1 full, EP2 spins, busy timer ticks
+uint16_t tmr_ovf; // Timer 0 overflows
+uint32_t pwr_us[3]; // Power sequencing phase times, Vbus settled after power off, Vbus settled and configuration done
+uint8_t pwr_tmo; // Power sequencing phase timeouts, bit per phase
+#define ep1_next(i) ((i)==EP1_SLOTS-1?0:(i)+1)
+#define ep1_drop {for(idx_r_ep1=0;idx_r_ep1<EP1_SLOTS;idx_r_ep1++) len_ep1[idx_r_ep1]=0; idx_r_ep1=idx_w_ep1; UEP1_DMA=(uint16_t)buf_ep1[idx_w_ep1]; UEP1_CTRL&=~0x08;} // Free all slots, keeps the data toggle
+#define ep1_reset {for(idx_r_ep1=0;idx_r_ep1<EP1_SLOTS;idx_r_ep1++) len_ep1[idx_r_ep1]=0; idx_r_ep1=idx_w_ep1=0; UEP1_CTRL=0x13; UEP1_DMA=(uint16_t)buf_ep1[0];}
 
 // Delay functions
 void udelay(uint8_t us) {while(us--) {SAFE_MOD++; SAFE_MOD++; SAFE_MOD++;}}
 void mdelay(uint8_t ms) {while(ms--) {udelay(250); udelay(250); udelay(250); udelay(242);}}
+void jtag_delay(void) {uint8_t d=jtag_pad; while(--d) SAFE_MOD++;}
+
+// Free-running timer in Fsys/12 ticks, timer 0 overflows extend it to 32 bits
+void tmr_isr(void) __interrupt(INT_NO_TMR0) __using(2) {tmr_ovf++;}
+uint32_t tmr_read(void)
+{
+	uint16_t ovf;
+	uint8_t h, l;
+	do {ovf=tmr_ovf; h=TH0; l=TL0;} while(ovf!=tmr_ovf || h!=TH0);
+	return (uint32_t)ovf<<16|(uint16_t)h<<8|l;
+}
+
+// JTAG clock TMS path, TDI low
+void jtag_path(uint8_t tms, uint8_t cnt)
+{
+	JEN=0; TDI=0; sta.bits+=cnt;
+	while(cnt--) {TMS=tms&0x01; tms>>=1; jtag_padx TCK=1; jtag_padx TCK=0;}
+}
+
+// FPGA status register over JTAG from any TAP state, ends in Reset
+uint32_t jtag_status(void)
+{
+	uint8_t i, ir=0x41;
+	uint32_t st=0;
+	jtag_path(0x1f, 5); jtag_path(0x06, 5); // Reset, Idle, Shift-IR
+	for(i=0;i<8;i++) {TMS=i==7; TDI=ir&0x01; ir>>=1; jtag_padx TCK=1; jtag_padx TCK=0;}
+	jtag_path(0x03, 4); // Update-IR, Shift-DR
+	for(i=0;i<32;i++) {TMS=i==31; jtag_padx st>>=1; if(TDO) st|=0x80000000; TCK=1; jtag_padx TCK=0;}
+	jtag_path(0x0f, 4); // Update-DR, Reset
+	sta.bits+=40;
+	return st;
+}
+
+// Vbus ADC sample, divider enabled by the caller
+uint8_t adc_read(void) {ADC_CTRL=0x10; while(ADC_CTRL&0x10); return ADC_DATA;}
 
 // PMU and CLKOUT functions
-void pmu_write(uint8_t val) {uint8_t i; SDA=0; udelay(5); SCL=0; i2c_tx(0x10) i2c_tx(0xf4) i2c_tx(val) SDA=0; udelay(5); SCL=1; udelay(5); SDA=1;}
+void pmu_write(uint8_t val) {uint8_t i; SDA=0; udelay(I2C_US); SCL=0; i2c_tx(0x10) i2c_tx(0xf4) i2c_tx(val) SDA=0; udelay(I2C_US); SCL=1; udelay(I2C_US); SDA=1;}
 void clk_on(uint8_t div, uint8_t jtag) {if(jtag) {PIN_FUNC&=~0x01; pin_mode(P1, 4, 3, 1) pin_mode(P1, 7, 0, 0) pin_mode(P1, 0, 1, 0)} else {PIN_FUNC|=0x01; pin_mode(P1, 0, 0, 0) pin_mode(P1, 7, 1, 0) pin_mode(P1, 4, 1, 0)} RCAP2=0xffff-div; T2MOD=0xc2; T2CON=0x04;}
 void clk_off(void) {pin_mode(P1, 0, 0, 0) pin_mode(P1, 7, 1, 0) pin_mode(P1, 4, 3, 1) T2CON=0x00; T2MOD=0x00; RCAP2=0x00;}
 
+// Vbus settle, samples until PWR_STABLE consecutive readings at or above min stay within 1 count or ms pass, returns 1 on timeout
+uint8_t adc_settle(uint8_t min, uint8_t ms)
+{
+	uint32_t t=tmr_read();
+	uint8_t v, p=0, n=0;
+	do {udelay(100); v=adc_read(); n=(v>=min && v+1>=p && v<=p+1)?n+1:0; p=v;} while(n<PWR_STABLE && tmr_read()-t<tmr_ms(ms));
+	return n<PWR_STABLE;
+}
+
+// Power sequencing phases, each records its time and sets its timeout bit
+// Power off keeps only the Vbus divider on and waits for Vbus to settle once the rail load is gone, the TAP floats while unpowered so it cannot tell
+void pwr_off(void)
+{
+	uint32_t t=tmr_read();
+	ADC_CFG=0x08; pmu_write(0x10);
+	if(adc_settle(0, PWR_OFF_MS)) pwr_tmo|=0x01; else mdelay(PWR_HOLD_MS);
+	ADC_CFG=0x00; pwr_us[0]=tmr_us(tmr_read()-t);
+}
+
+// Power on to pmu with configuration held, waits for Vbus to recover from the inrush, leaves the divider on for the next pmu_write to clear
+void pwr_rail(uint8_t pmu)
+{
+	uint32_t t=tmr_read();
+	ADC_CFG=0x08; pmu_write(pmu|0x10);
+	if(adc_settle(PWR_VBUS, PWR_RAIL_MS)) pwr_tmo|=0x02;
+	ADC_CFG=0x00; pwr_us[1]=tmr_us(tmr_read()-t);
+}
+
+// Configuration released, waits for the FPGA to load its design or come up blank
+void pwr_cfg(void)
+{
+	uint32_t t=tmr_read(), s;
+	do {udelay(100); s=jtag_status();} while(!fpga_rdy(s) && tmr_read()-t<tmr_ms(PWR_CFG_MS));
+	if(!fpga_rdy(s)) pwr_tmo|=0x04;
+	pwr_us[2]=tmr_us(tmr_read()-t);
+}
+
 // Write or read control byte
 uint8_t ctl_write(uint8_t mask, uint8_t opr, uint8_t val)
 {
 	static uint8_t ctl_byte=0x00;
-	if(mask==0x00 && opr==0x01 && ctl_byte&0x01) {URS=0; pmu_write(pmu_byte); udelay(250); pmu_write(pmu_byte|0x08); mdelay(40); URS=1; return 0;} // Reset FPGA
+	if(mask==0x00 && opr==0x01 && ctl_byte&0x01) {pwr_us[0]=pwr_us[1]=pwr_tmo=0; URS=0; pmu_write(pmu_byte); udelay(250); pmu_write(pmu_byte|0x08); pwr_cfg(); URS=1; return 0;} // Reset FPGA
 	if(mask==0x00 && opr==0x02 && ctl_byte&0x01) {URS=0; udelay(250); URS=1; return 0;} // Reset user logic
 	if(mask==0x00 && opr==0x03 && ctl_byte&0x01) {if(val) clk_on(3, 1); else if(ctl_byte&0x04) clk_on((ctl_byte&0x08)?0:7, 0); else clk_off(); return 0;} // Pulse TCK RTI clock
 	if(mask==0x00 && opr==0x04) {if(val) {ADC_CFG=0x08; pmu_write(pmu_byte|0x10);} else {ADC_CFG=0x00; pmu_write(pmu_byte&~0x10);} return 0;} // Enable Vbus divider
@@ -109,12 +305,16 @@ uint8_t ctl_write(uint8_t mask, uint8_t opr, uint8_t val)
 	if(!(ctl_byte&0x04) || !(ctl_byte&0x01)) clk_off(); // Disable clock
 	if((ctl_old^ctl_byte)&0x01) // Power status changed
 	{
-		URS=0; pmu_write(0x00); mdelay(10); pmu_write(0x08); URS=1; // Power status change, power off first
-		if(ctl_byte&0x01) {URS=0; pmu_write(pmu_byte); mdelay(5); pmu_write(pmu_byte|0x08); mdelay(40); URS=1;} // Power on
+		pwr_us[1]=pwr_us[2]=pwr_tmo=0;
+		URS=0; pwr_off(); pmu_write(0x08); URS=1; // Power status change, power off first
+		if(ctl_byte&0x01) {URS=0; pwr_rail(pmu_byte); pmu_write(pmu_byte|0x08); pwr_cfg(); URS=1;} // Power on
 	}
 	return ctl_byte;
 }
 
+// Set SPI clock divider and bitbang padding
+void rate_set(uint8_t div, uint8_t pad) {spi_div=div; jtag_pad=pad; SPI0_CK_SE=div;}
+
 // Read data flash
 void rom_read(uint8_t add, uint8_t *buf, uint8_t len)
 {
@@ -132,14 +332,15 @@ void rom_write(uint8_t add, uint8_t *buf, uint8_t len)
 	SAFE_MOD=0x55; SAFE_MOD=0xaa; GLOBAL_CFG&=~0x04; SAFE_MOD=0x00; // Lock flash
 }
 
-// SPI write bytes
-void spi_write(uint8_t __xdata *obuf, uint8_t len, uint8_t jtag)
+// SPI write bytes, mode bit 0 selects JTAG, bit 1 keeps NCS asserted
+void spi_write(uint8_t __xdata *obuf, uint8_t len, uint8_t mode)
 {
 	SPI0_CTRL=0x60; // Enable SPI
-	JEN=!jtag; if(!jtag) TMS=0; // Manipulate IOs
-	XBUS_AUX=0x00; SAFE_MOD=obuf[0]; XBUS_AUX=0x04; // Populate DPTR 0
-	while(len>=8) {spi_tx8 len-=8;} while(len--) {spi_tx} XBUS_AUX=0x00; // Transfer data
-	if(!jtag) TMS=1;
+	JEN=!(mode&0x01); TMS=0; // Manipulate IOs
+	sta.spi+=len;
+	if(spi_div>2) while(len--) {spi_put(*obuf) obuf++;} // Slower clocks poll S0_FREE
+	else {XBUS_AUX=0x00; SAFE_MOD=obuf[0]; XBUS_AUX=0x04; while(len>=8) {spi_tx8 len-=8;} while(len--) {spi_tx} XBUS_AUX=0x00;} // Populate DPTR 0 and transfer data
+	if(!mode) TMS=1;
 	SPI0_CTRL=0x02; // Disable SPI
 }
 
@@ -147,61 +348,312 @@ void spi_write(uint8_t __xdata *obuf, uint8_t len, uint8_t jtag)
 void spi_write_read(uint8_t __xdata *obuf, uint8_t __xdata *ibuf, uint8_t len, uint8_t jtag)
 {
 	SPI0_CTRL=0x60; // Enable SPI
-	JEN=!jtag; if(!jtag) TMS=0; // Manipulate IOs
-	XBUS_AUX=0x00; SAFE_MOD=obuf[0]; XBUS_AUX=0x01; SAFE_MOD=ibuf[0]; XBUS_AUX=0x04; // Populate DPTRs
-	while(len>=8) {spi_rx8 obuf+=8; len-=8;} while(len--) {spi_rx} XBUS_AUX=0x00; // Transfer data
+	JEN=!jtag; TMS=0; // Manipulate IOs
+	sta.spi+=len;
+	if(spi_div>2) while(len--) {spi_put(*obuf) obuf++; *ibuf++=SPI0_DATA;} // Slower clocks poll S0_FREE
+	else {XBUS_AUX=0x00; SAFE_MOD=obuf[0]; XBUS_AUX=0x01; SAFE_MOD=ibuf[0]; XBUS_AUX=0x04; while(len>=8) {spi_rx8 obuf+=8; len-=8;} while(len--) {spi_rx} XBUS_AUX=0x00;} // Populate DPTRs and transfer data
 	if(!jtag) TMS=1;
 	SPI0_CTRL=0x02; // Disable SPI
 }
 
-// JTAG write bytes
+// SPI fill bytes, JTAG holds TMS low
+void spi_fill(uint8_t val, uint16_t cnt)
+{
+	SPI0_CTRL=0x60; // Enable SPI
+	JEN=0; TMS=0; // Manipulate IOs
+	sta.spi+=cnt;
+	while(cnt>=8) {spi_put(val) spi_put(val) spi_put(val) spi_put(val) spi_put(val) spi_put(val) spi_put(val) spi_put(val) cnt-=8;}
+	while(cnt--) {spi_put(val)}
+	SPI0_CTRL=0x02; // Disable SPI
+}
+
+// SPI read with 0xff TX, NCS already low and SPI enabled by the caller
+void spi_read(uint8_t __xdata *ibuf, uint8_t len)
+{
+	sta.spi+=len;
+	if(spi_div>2) while(len--) {spi_put(0xff) *ibuf++=SPI0_DATA;} // Slower clocks poll S0_FREE
+	else {XBUS_AUX=0x00; SAFE_MOD=ibuf[0]; XBUS_AUX=0x04; while(len>=8) {spi_ff8 len-=8;} while(len--) {spi_ff} XBUS_AUX=0x00;} // Populate DPTR 0 and transfer data
+}
+
+// SPI flash CRC-16/CCITT of len bytes at adr, 0 for 64 KiB, the next byte shifts while the last one is folded in
+uint16_t spi_crc(uint32_t adr, uint16_t len)
+{
+	uint8_t h=0xff, l=0xff, x;
+	SPI0_CTRL=0x60; // Enable SPI
+	JEN=1; TMS=0; // Manipulate IOs
+	sta.spi+=4+(uint32_t)(len?len:0x10000);
+	spi_put(0x03) spi_put(adr>>16) spi_put(adr>>8) spi_put(adr)
+	SPI0_DATA=0xff;
+	while(--len) {while(!S0_FREE); x=h^SPI0_DATA; SPI0_DATA=0xff; h=l^crc_hi[x]; l=crc_lo[x];}
+	while(!S0_FREE); x=h^SPI0_DATA; h=l^crc_hi[x]; l=crc_lo[x];
+	TMS=1; // Release NCS
+	SPI0_CTRL=0x02; // Disable SPI
+	return (uint16_t)h<<8|l;
+}
+
+// SPI flash wait until WIP clears, polls status register for up to ms milliseconds on timer 0 whatever the SPI divider, returns 1 on timeout
+uint8_t spi_wait(uint16_t ms)
+{
+	uint8_t st;
+	uint32_t t=tmr_read();
+	SPI0_CTRL=0x60; JEN=1; TMS=0; spi_put(0x05) // Read status register continuously
+	do {spi_put(0xff) st=SPI0_DATA;} while(st&0x01 && tmr_read()-t<tmr_ms(ms));
+	TMS=1; SPI0_CTRL=0x02;
+	return st&0x01;
+}
+
+// SPI flash start page program at stream address, NCS stays asserted for page data
+void spi_page(void)
+{
+	SPI0_CTRL=0x60; JEN=1; TMS=0; spi_put(0x06) TMS=1; // Write enable
+	nop nop nop nop TMS=0; spi_put(0x02) spi_put(stm_adr>>16) spi_put(stm_adr>>8) spi_put(stm_adr) // Page program
+}
+
+// JTAG write bytes, kernels rotate TMS and TDI through carry with DPTR0 on mbuf and DPTR1 on obuf
 void jtag_write(uint8_t __xdata *mbuf, uint8_t __xdata *obuf, uint8_t len)
 {
 	uint8_t i, tms, tdi;
-	JEN=0;
-	for(i=0;i<len;i++) {tms=mbuf[i]; tdi=obuf[i]; jtag_tx}
+	if(!len) return;
+	JEN=0; sta.bits+=len<<3; jtag_cnt=len;
+	jtag_padk(jtag_kw, jtag_wr, {XBUS_AUX=0x00; SAFE_MOD=mbuf[0]; XBUS_AUX=0x01; SAFE_MOD=obuf[0]; jtag_lw})
 }
 
-// JTAG write and read bytes
+// JTAG write and read bytes, kernels store TDO over obuf and it is copied to ibuf after
 void jtag_write_read(uint8_t __xdata *mbuf, uint8_t __xdata *obuf, uint8_t __xdata *ibuf, uint8_t len)
 {
 	uint8_t i, tms, tdi, tdo;
-	JEN=0;
-	for(i=0;i<len;i++) {tms=mbuf[i]; tdi=obuf[i]; tdo=0; jtag_rx ibuf[i]=tdo;}
+	if(!len) return;
+	JEN=0; sta.bits+=len<<3; jtag_cnt=len;
+	jtag_padk(jtag_kwr, jtag_wrr, {XBUS_AUX=0x00; SAFE_MOD=mbuf[0]; XBUS_AUX=0x01; SAFE_MOD=obuf[0]; jtag_lr})
+	if(jtag_pad<=1) for(i=0;i<len;i++) ibuf[i]=obuf[i];
+}
+
+// JTAG write bits with TMS low, last byte holds 1-8 bits, final bit carries TMS exit
+void jtag_write_bits(uint8_t __xdata *obuf, uint8_t len, uint8_t last, uint8_t exit)
+{
+	uint8_t i, m, tms=0, tdi;
+	JEN=0; TMS=0; sta.bits+=((len-1)<<3)+last; jtag_cnt=len-1;
+	if(jtag_cnt) {jtag_padk(jtag_kl, jtag_wb, {XBUS_AUX=0x00; SAFE_MOD=obuf[0]; XBUS_AUX=0x04; jtag_ll}) if(jtag_pad<=1) obuf+=len-1;} // Whole bytes, DPTR0 on obuf
+	tdi=*obuf;
+	for(m=0x01;--last;m<<=1) jtag_txb(m, jtag_padx)
+	tms=exit?m:0; jtag_txb(m, jtag_padx)
+}
+
+// JTAG write and read bits with TMS low, last byte holds 1-8 bits, final bit carries TMS exit
+void jtag_write_read_bits(uint8_t __xdata *obuf, uint8_t __xdata *ibuf, uint8_t len, uint8_t last, uint8_t exit)
+{
+	uint8_t i, m, tms=0, tdi, tdo;
+	JEN=0; TMS=0; sta.bits+=((len-1)<<3)+last; jtag_cnt=len-1;
+	if(jtag_cnt) {jtag_padk(jtag_klr, jtag_wrb, {XBUS_AUX=0x00; SAFE_MOD=obuf[0]; XBUS_AUX=0x01; SAFE_MOD=ibuf[0]; XBUS_AUX=0x04; jtag_ll}) if(jtag_pad<=1) {obuf+=len-1; ibuf+=len-1;}} // Whole bytes, DPTR0 on obuf and DPTR1 on ibuf
+	tdi=*obuf; tdo=0;
+	for(m=0x01;--last;m<<=1) jtag_rxb(m, jtag_padx)
+	tms=exit?m:0; jtag_rxb(m, jtag_padx)
+	*ibuf=tdo;
+}
+
+// JTAG scan, buf holds [path, entry TMS, exit TMS, last byte bits, TDI bytes], path holds entry and exit clock counts
+// Exit path starts on the final data bit, reads TDO of data bits into ibuf if not null
+uint8_t jtag_scan(uint8_t __xdata *buf, uint8_t __xdata *ibuf, uint8_t len)
+{
+	uint8_t ent=buf[0]>>4, ext=buf[0]&0x0f, tms=buf[2];
+	if(len<4 || ent>8 || ext>8) return 1; // Invalid header
+	len-=4;
+	if(len && (buf[3]<1 || buf[3]>8)) return 1; // Invalid bit count
+	jtag_path(buf[1], ent);
+	if(len && ibuf) jtag_write_read_bits(buf+4, ibuf, len, buf[3], ext?tms&0x01:0);
+	else if(len) jtag_write_bits(buf+4, len, buf[3], ext?tms&0x01:0);
+	if(len && ext) {tms>>=1; ext--;}
+	jtag_path(tms, ext);
+	return 0;
+}
+
+// Verify stream, data holds records of [TDI, expected, mask] with fields selected by mode bits 1-3
+// Mode bit 0 selects JTAG, missing TDI shifts 0xff, missing mask compares all bits, TDO is folded into a CRC-16/CCITT
+void stm_verify(uint8_t __xdata *buf, uint8_t len)
+{
+	uint8_t tdo, x;
+	SPI0_CTRL=0x60; // Enable SPI
+	JEN=!(stm_mod&0x01); TMS=0; // Manipulate IOs
+	while(len--)
+	{
+		if(!stm_fld) {stm_fld=stm_mod&0x0e; stm_tdi=0xff; stm_msk=0xff;} // Start of record
+		if(stm_fld&0x02) {stm_tdi=*buf++; stm_fld&=~0x02;}
+		else if(stm_fld&0x04) {stm_exp=*buf++; stm_fld&=~0x04;}
+		else {stm_msk=*buf++; stm_fld=0;}
+		if(stm_fld) continue;
+		spi_put(stm_tdi) tdo=SPI0_DATA; sta.spi++;
+		x=(stm_crc>>8)^tdo; x^=x>>4; stm_crc=(stm_crc<<8)^((uint16_t)x<<12)^((uint16_t)x<<5)^x;
+		if(stm_mod&0x04 && (tdo^stm_exp)&stm_msk && stm_bad==0xffffffff) stm_bad=stm_cnt;
+		stm_cnt++;
+	}
+	if(!stm_len && !(stm_mod&0x01)) TMS=1; // SPI releases NCS at stream end
+	SPI0_CTRL=0x02; // Disable SPI
+}
+
+// Compressed JTAG stream, every packet holds whole tokens, literal [n-1, bytes] for n up to 128 and run [0x80+n-2, byte] for n from 2 to 128
+// Long run [0xff, n, byte] has a 16-bit count, literals go straight to the SPI shifter and runs are filled on the device
+void stm_expand(uint8_t __xdata *buf, uint8_t len)
+{
+	uint8_t t, n;
+	uint16_t cnt;
+	while(len)
+	{
+		t=*buf++; len--;
+		if(t<0x80) {n=t+1; if(n>len) n=len; spi_write(buf, n, 0x01); buf+=n; len-=n; continue;} // Literal
+		if(t==0xff) {if(len<3) break; cnt=*(uint16_t __xdata *)buf; buf+=2; len-=2;} // Long run
+		else {if(!len) break; cnt=t-0x7e;} // Run
+		spi_fill(*buf++, cnt); len--;
+	}
+}
+
+// Stream write, feeds raw packet data into the sink until the announced length is used up
+void stm_write(uint8_t __xdata *buf, uint8_t len)
+{
+	uint8_t n;
+	if(len>stm_len) len=stm_len;
+	stm_len-=len;
+	if(stm_snk==0x03) {stm_verify(buf, len); return;}
+	if(stm_snk==0x04) {stm_expand(buf, len); return;}
+	if(stm_snk<0x02) {spi_write(buf, len, stm_snk?0x01:(stm_len?0x02:0x00)); return;} // SPI sink releases NCS at stream end
+	while(len) // SPI flash sink splits data at page boundaries and waits for each page program
+	{
+		if(!stm_pg) {spi_page(); stm_pg=1;}
+		n=0-(uint8_t)stm_adr; if(!n || n>len) n=len; // Bytes to page end
+		spi_write(buf, n, 0x02); buf+=n; len-=n; stm_adr+=n;
+		if(!(uint8_t)stm_adr || (!stm_len && !len)) {TMS=1; stm_pg=0; if(spi_wait(20)) usb_err=1;}
+	}
 }
 
 // USB packet processing
+// Close a pushed sequence with a zero-length packet, a host that stops reading for 100 ms loses the packet still queued
+void usb_end(void)
+{
+	uint32_t t=tmr_read();
+	ret_bat=0;
+	if(ret_len) usb_flush
+	while(ep2_pend && tmr_read()-t<tmr_ms(100));
+	EA=0; if(ep2_pend) {ep2_pend=0; sta.spin++;} EA=1;
+	usb_flush // Zero-length packet
+}
+
+// Capture, repeats a JTAG scan or SPI transaction and streams the read bytes to EP2 IN as fast as the host drains them
+// Runs for cnt samples, 0 for no limit, or until the next OUT packet arrives, packets hold whole samples and a zero-length packet ends it
+uint8_t usb_capture(uint32_t cnt, uint8_t __xdata *buf, uint8_t len, uint8_t jtag)
+{
+	uint8_t n, err=0, nxt=ep1_next(idx_r_ep1);
+	if(ret_bat || !len || (jtag && len<5)) return 1; // Not in a batch
+	n=jtag?len-4:len;
+	if(n>64) return 1;
+	ret_bat=1; // Pack samples until the packet is full
+	do
+	{
+		usb_hold(n) if(usb_stop) break;
+		if(jtag) {if(err=jtag_scan(buf, usb_buf, len)) break;} else spi_write_read(buf, usb_buf, len, 0);
+		usb_tx(n)
+	} while(--cnt && !usb_stop);
+	usb_end();
+	return err;
+}
+
+// SPI readback, clocks the command out then reads cnt bytes with 0xff TX generated here straight into EP2 packets
+// NCS stays low throughout, any OUT packet stops it early and a zero-length packet ends it
+uint8_t usb_readback(uint32_t cnt, uint8_t __xdata *buf, uint8_t len)
+{
+	uint8_t n, nxt=ep1_next(idx_r_ep1);
+	if(ret_bat) return 1; // Not in a batch
+	spi_write(buf, len, 0x02);
+	SPI0_CTRL=0x60; // Enable SPI again, NCS still low
+	ret_bat=1;
+	for(;cnt && !usb_stop;cnt-=n)
+	{
+		n=cnt<64?cnt:64;
+		usb_hold(n) if(usb_stop) break;
+		spi_read(usb_buf, n);
+		usb_tx(n)
+	}
+	TMS=1; // Release NCS
+	SPI0_CTRL=0x02; // Disable SPI
+	usb_end();
+	return 0;
+}
+
+// SPI flash sector CRCs, cnt sectors of 2^shift bytes from adr, 32 CRCs per packet, stops and ends like usb_readback
+uint8_t usb_sectors(uint32_t adr, uint16_t cnt, uint8_t shift)
+{
+	uint16_t crc;
+	uint8_t nxt=ep1_next(idx_r_ep1);
+	if(ret_bat || shift<8 || shift>16) return 1; // Not in a batch, 256 bytes to 64 KiB
+	ret_bat=1;
+	for(;cnt && !usb_stop;cnt--)
+	{
+		crc=spi_crc(adr, (uint16_t)(1UL<<shift));
+		usb_hold(2) if(usb_stop) break;
+		usb_buf[0]=crc; usb_buf[1]=crc>>8; usb_tx(2)
+		adr+=1UL<<shift;
+	}
+	usb_end();
+	return 0;
+}
+
 void usb_parse(uint8_t __xdata *buf, uint8_t len)
 {
 	uint8_t __xdata *cmd=buf;
 	uint8_t __xdata *arg=buf+1;
 	uint8_t __xdata *dat=buf+2;
 	uint8_t val;
-	static uint8_t err=0;
 	if(len<2) return; // Invalid packet
 	len-=2;
+	if(*cmd<5) sta.cmd[*cmd]++;
 	if(*cmd==0x00) // JTAG adapter control
-		if(*arg==0x00) {if(len==1) {if(*dat==0x00) {ctl_write(0x00, 0x01, 0x00); err=0;} else if(*dat==0x01) {ctl_write(0x00, 0x02, 0x00); err=0;} else err=1;} else err=1;} // [0x00, 0x00, user], reset FPGA
-		else if(*arg==0x01) {if(len==1) {if(*dat==0x00) {usb_ret(ctl_write(0x00, 0x00, 0x00)) err=0;} else if(*dat==0x01) {rom_read(0x00, &val, 1); usb_ret(val) err=0;} else err=1;} else err=1;} // [0x00, 0x01, index], read control bytes
-		else if(*arg==0x02) {if(len==2) {if(*dat==0) {ctl_write(0xff, 0x00, *(dat+1)); err=0;} else if(*dat==1) {rom_write(0x00, dat+1, 1); err=0;} else err=1;} else err=1;} // [0x00, 0x02, index, value], write control bytes
-		else if(*arg==0x03) {if(len==0) {ctl_write(0x00, 0x04, 0x01); ADC_CTRL=0x10; while(ADC_CTRL&0x10); usb_ret(ADC_DATA) ctl_write(0x00, 0x04, 0x00); err=0;} else err=1;} // [0x00, 0x03], read ADC value
-		else if(*arg==0x04) {if(len==3) {if(*dat==1) ctl_write(0x00, 0x03, 0x01); if(*(dat+1)) mdelay(*(dat+1)); if(*(dat+2)) udelay(*(dat+2)); if(*dat==1) ctl_write(0x00, 0x03, 0x00); err=0;} else err=1;} // [0x00, 0x04, pulse, ms, us], delay and pulse clock
-		else if(*arg==0x05) {if(len==0) {usb_ret(err); err=0;} else err=1;} // [0x00, 0x05], get error status
-		else if(*arg==0xfd) {if(len==0) {while(UEP2_T_LEN); rom_read(0x01, buf_ep2, 16); usb_tx(16); err=0;} else err=1;} // [0x00, 0xfd], read serial number
-		else if(*arg==0xfe) {if(len<=16) {for(;len<16;len++) dat[len]=0x00; rom_write(0x01, dat, len); err=0;} else err=1;} // [0x00, 0xfe, bytes], Write serial number
-		else if(*arg==0xff) {if(len==0) {EA=0; USB_CTRL=0x06; USB_INT_FG=0xff; mdelay(100); ((void (*)(void))0x3800)();} else err=1;} // [0x00, 0xff], enter ISP mode
-		else err=1;
+		if(*arg==0x00) {if(len==1) {if(*dat==0x00) {ctl_write(0x00, 0x01, 0x00); usb_err=0;} else if(*dat==0x01) {ctl_write(0x00, 0x02, 0x00); usb_err=0;} else usb_err=1;} else usb_err=1;} // [0x00, 0x00, user], reset FPGA
+		else if(*arg==0x01) {if(len==1) {if(*dat==0x00) {usb_ret(ctl_write(0x00, 0x00, 0x00)) usb_err=0;} else if(*dat==0x01) {rom_read(0x00, &val, 1); usb_ret(val) usb_err=0;} else usb_err=1;} else usb_err=1;} // [0x00, 0x01, index], read control bytes
+		else if(*arg==0x02) {if(len==2) {if(*dat==0) {ctl_write(0xff, 0x00, *(dat+1)); usb_err=0;} else if(*dat==1) {rom_write(0x00, dat+1, 1); usb_err=0;} else usb_err=1;} else usb_err=1;} // [0x00, 0x02, index, value], write control bytes
+		else if(*arg==0x03) {if(len==0) {ctl_write(0x00, 0x04, 0x01); usb_ret(adc_read()) ctl_write(0x00, 0x04, 0x00); usb_err=0;} else usb_err=1;} // [0x00, 0x03], read ADC value
+		else if(*arg==0x04) {if(len==3) {if(*dat==1) ctl_write(0x00, 0x03, 0x01); if(*(dat+1)) mdelay(*(dat+1)); if(*(dat+2)) udelay(*(dat+2)); if(*dat==1) ctl_write(0x00, 0x03, 0x00); usb_err=0;} else usb_err=1;} // [0x00, 0x04, pulse, ms, us], delay and pulse clock
+		else if(*arg==0x05) {if(len==0) {usb_ret(usb_err); usb_err=0;} else usb_err=1;} // [0x00, 0x05], get error status
+		else if(*arg==0x06) {if(len<=1) {usb_wait(sizeof(sta)) for(val=0;val<sizeof(sta);val++) usb_buf[val]=((uint8_t __xdata *)&sta)[val]; usb_tx(sizeof(sta)) if(len && *dat) for(val=0;val<sizeof(sta);val++) ((uint8_t __xdata *)&sta)[val]=0; usb_err=0;} else usb_err=1;} // [0x00, 0x06, clear], read performance counters
+		else if(*arg==0x07) {if(len==1 && *dat<=0x01) {usb_wait(2) if(*dat) rom_read(0x11, usb_buf, 2); else {usb_buf[0]=spi_div; usb_buf[1]=jtag_pad;} usb_tx(2) usb_err=0;} else usb_err=1;} // [0x00, 0x07, index], read SPI divider and bitbang padding
+		else if(*arg==0x08) {if(len==3 && *dat<=0x01 && rate_ok(dat[1], dat[2])) {if(*dat) rom_write(0x11, dat+1, 2); else rate_set(dat[1], dat[2]); usb_err=0;} else usb_err=1;} // [0x00, 0x08, index, divider, padding], write SPI divider and bitbang padding
+		else if(*arg==0x09) {if(len==0) {usb_wait(13) for(val=0;val<12;val++) usb_buf[val]=((uint8_t *)pwr_us)[val]; usb_buf[12]=pwr_tmo; usb_tx(13) usb_err=0;} else usb_err=1;} // [0x00, 0x09], read power sequencing phase times in us and timeouts
+		else if(*arg==0xfd) {if(len==0) {usb_wait(16) rom_read(0x01, usb_buf, 16); usb_tx(16) usb_err=0;} else usb_err=1;} // [0x00, 0xfd], read serial number
+		else if(*arg==0xfe) {if(len<=16) {rom_write(0x01, dat, len); for(val=0x00;len<16;len++) rom_write(0x01+len, &val, 1); usb_err=0;} else usb_err=1;} // [0x00, 0xfe, bytes], Write serial number
+		else if(*arg==0xff) {if(len==0) {EA=0; USB_CTRL=0x06; USB_INT_FG=0xff; mdelay(100); ((void (*)(void))0x3800)();} else usb_err=1;} // [0x00, 0xff], enter ISP mode
+		else usb_err=1;
 	else if(*cmd==0x01 && len) // JTAG operation, must have a data payload
-		if(*arg==0x00) {if(!(len&1)) {jtag_write(dat, dat+(len>>1), len>>1); err=0;} else err=1;} // JTAG write
-		else if(*arg==0x01) {if(!(len&1)) {while(UEP2_T_LEN); jtag_write_read(dat, dat+(len>>1), buf_ep2, len>>1); usb_tx(len>>1); err=0;} else err=1;} // JTAG write and read
-		else if(*arg==0x02) {spi_write(dat, len, 1); err=0;}
-		else if(*arg==0x03) {while(UEP2_T_LEN); spi_write_read(dat, buf_ep2, len, 1); usb_tx(len); err=0;}
-		else err=1;
+		if(*arg==0x00) {if(!(len&1)) {jtag_write(dat, dat+(len>>1), len>>1); usb_err=0;} else usb_err=1;} // JTAG write
+		else if(*arg==0x01) {if(!(len&1)) {usb_wait(len>>1) jtag_write_read(dat, dat+(len>>1), usb_buf, len>>1); usb_tx(len>>1) usb_err=0;} else usb_err=1;} // JTAG write and read
+		else if(*arg==0x02) {spi_write(dat, len, 1); usb_err=0;}
+		else if(*arg==0x03) {usb_wait(len) spi_write_read(dat, usb_buf, len, 1); usb_tx(len) usb_err=0;}
+		else if(*arg==0x04) usb_err=jtag_scan(dat, 0, len); // [0x01, 0x04, path, entry, exit, bits, TDI], JTAG scan bits
+		else if(*arg==0x05) {if(len>4) {usb_wait(len-4) usb_err=jtag_scan(dat, usb_buf, len); if(!usb_err) usb_tx(len-4)} else usb_err=1;} // [0x01, 0x05, path, entry, exit, bits, TDI], JTAG scan and read bits
+		else usb_err=1;
 	else if(*cmd==0x02 && len) // SPI operation, must have a data payload
-		if(*arg==0x00) {spi_write(dat, len, 0); err=0;}
-		else if(*arg==0x01) {while(UEP2_T_LEN); spi_write_read(dat, buf_ep2, len, 0); usb_tx(len); err=0;}
-		else err=1;
-	else err=1;
+		if(*arg==0x00) {spi_write(dat, len, 0); usb_err=0;}
+		else if(*arg==0x01) {usb_wait(len) spi_write_read(dat, usb_buf, len, 0); usb_tx(len) usb_err=0;}
+		else if(*arg==0x02) {if(len==2) usb_err=spi_wait(*(uint16_t __xdata *)dat); else usb_err=1;} // [0x02, 0x02, ms], wait for flash WIP to clear
+		else usb_err=1;
+	else if(*cmd==0x03) // Stream operation, later packets are raw data
+		if((*arg<=0x01 || *arg==0x04) && len>=4) {stm_snk=*arg; stm_len=*(uint32_t __xdata *)dat; stm_write(dat+4, len-4); usb_err=0;} // [0x03, sink, length, data], stream to SPI, JTAG or compressed JTAG
+		else if(*arg==0x02 && len>=8) {stm_snk=*arg; stm_pg=0; stm_len=*(uint32_t __xdata *)dat; stm_adr=*(uint32_t __xdata *)(dat+4); stm_write(dat+8, len-8);} // [0x03, 0x02, length, address, data], stream to SPI flash pages, error status is kept across streams
+		else if(*arg==0x03 && len>=6 && len>=6+dat[5] && dat[4]&0x06 && (dat[4]&0x0c)!=0x08) {stm_snk=*arg; stm_len=*(uint32_t __xdata *)dat; stm_mod=dat[4]; stm_fld=0; stm_crc=0xffff; stm_cnt=0; stm_bad=0xffffffff; spi_write(dat+6, dat[5], (stm_mod&0x01)?0x01:0x02); stm_write(dat+6+dat[5], len-6-dat[5]); usb_err=0;} // [0x03, 0x03, length, mode, prefix length, prefix, data], verify stream, prefix TDO is not checked
+		else if(*arg==0x80) {if(len==0) {usb_wait(6) *(uint16_t __xdata *)usb_buf=stm_crc; *(uint32_t __xdata *)(usb_buf+2)=stm_bad; usb_tx(6) usb_err=0;} else usb_err=1;} // [0x03, 0x80], read verify CRC and first mismatch offset
+		else if((*arg==0x81 || *arg==0x82) && len>4) usb_err=usb_capture(*(uint32_t __xdata *)dat, dat+4, len-4, *arg==0x81); // [0x03, 0x81/0x82, count, scan or SPI bytes], capture JTAG scan or SPI transaction samples
+		else if(*arg==0x83) usb_err=len?1:0; // [0x03, 0x83], stop capture, any OUT packet does
+		else if(*arg==0x84 && len>4) usb_err=usb_readback(*(uint32_t __xdata *)dat, dat+4, len-4); // [0x03, 0x84, length, command], SPI readback of length bytes after the command
+		else if(*arg==0x85 && len==7) usb_err=usb_sectors(*(uint32_t __xdata *)dat, *(uint16_t __xdata *)(dat+4), dat[6]); // [0x03, 0x85, address, sectors, size shift], SPI flash sector CRCs
+		else usb_err=1;
+	else usb_err=1;
+}
+
+// USB batch processing, buf holds [0x04, 0x00, (length, cmd, arg, data)...], read results share one EP2 IN packet
+void usb_batch(uint8_t __xdata *buf, uint8_t len)
+{
+	uint8_t i, n;
+	if(len<2 || buf[1]!=0x00) {usb_err=1; return;}
+	ret_bat=1;
+	for(i=2;i<len;i+=n+1) {n=buf[i]; if(n<2 || i+n>=len) {usb_err=1; break;} usb_parse(buf+i+1, n);} // Sub-commands are length-tagged
+	ret_bat=0;
+	if(ret_len) usb_flush
 }
 
 // EP0 setup handler
@@ -214,7 +666,13 @@ void usb_setup(uint8_t *scode, uint8_t *slen, uint8_t *config)
 	if(buf_ep0[7]) *slen=64;
 	len=0;
 	*scode=buf_ep0[1];
-	if((buf_ep0[0]&0x60)==0) // Standard request
+	if((buf_ep0[0]&0x60)==0x40) // Vendor request
+	{
+		if(*scode==0x01) {stm_abt=1; ep2_pend=0;} // Abort stream and pushed sequences, a response waiting for EP2 IN is dropped
+		else if(*scode==0x02) {buf_ep0[0]=stm_abt; len=*slen?1:0;} // Read abort pending
+		else goto ep0_stall;
+	}
+	else if((buf_ep0[0]&0x60)==0) // Standard request
 		if(*scode==0x06) // Get descriptor
 		{
 			if(buf_ep0[3]==0x01) usb_txdesc(desc_dev) // Device descriptor
@@ -230,7 +688,7 @@ void usb_setup(uint8_t *scode, uint8_t *slen, uint8_t *config)
 		}
 		else if(*scode==0x05) *slen=buf_ep0[2]; // Set address
 		else if(*scode==0x08) {buf_ep0[0]=*config; len=*slen?1:0;} // Get config
-		else if(*scode==0x09) *config=buf_ep0[2]; // Set config
+		else if(*scode==0x09) {*config=buf_ep0[2]; stm_abt=1;} // Set config, a new host session starts without stream state
 		else if(*scode==0x0a) {buf_ep0[0]=0x00; len=*slen?1:0;} // Get interface
 		else if(*scode==0x00) // Get status
 		{
@@ -260,8 +718,8 @@ void usb_isr(void) __interrupt(INT_NO_USB) __using(1)
 	if(UIF_TRANSFER) // Transfer done
 	{
 		token=USB_INT_ST&0x3f;
-		if(token==0x01 && U_TOG_OK) {if(len_ep1_r) UEP1_CTRL|=0x08; len_ep1_w=USB_RX_LEN; idx_r_ep1=1-idx_r_ep1; UEP1_DMA=(uint16_t)buf_ep1_w;} // EP1 OUT
-		else if(token==0x22 && U_TOG_OK) {UEP2_T_LEN=0; UEP2_CTRL|=0x02;} // EP2 IN
+		if(token==0x01 && U_TOG_OK && USB_RX_LEN) {len_ep1[idx_w_ep1]=USB_RX_LEN; idx_w_ep1=ep1_next(idx_w_ep1); UEP1_DMA=(uint16_t)buf_ep1[idx_w_ep1]; if(len_ep1[idx_w_ep1]) UEP1_CTRL|=0x08;} // EP1 OUT, NAK when the ring is full, a zero-length packet keeps the slot
+		else if(token==0x22 && U_TOG_OK) {if(ep2_pend) {UEP2_DMA=(uint16_t)buf_ep2[idx_w_ep2^1]; UEP2_T_LEN=len_ep2; ep2_pend=0;} else {UEP2_T_LEN=0; UEP2_CTRL|=0x02; ep2_busy=0;}} // EP2 IN, arm the queued packet or NAK
 		else if(token==0x30) usb_setup(&scode, &slen, &config); // EP0 setup
 		else if(token==0x20) {if(scode==0x05) USB_DEV_AD=slen; UEP0_T_LEN=0; UEP0_CTRL=0x02;} // EP0 IN
 		else if(token==0x00) UEP0_CTRL=0x02; // EP0 OUT
@@ -270,9 +728,9 @@ void usb_isr(void) __interrupt(INT_NO_USB) __using(1)
 	else if(UIF_BUS_RST) // Bus reset
 	{
 		UEP0_CTRL=0x02; // Reset EP0 IN/OUT
-		UEP1_CTRL=0x13; idx_r_ep1=1; UEP1_DMA=(uint16_t)buf_ep1_w; len_ep1_r=len_ep1_w=0; // Reset EP1 OUT
-		UEP2_CTRL=0x1e; UEP2_DMA=(uint16_t)buf_ep2; UEP2_T_LEN=0; // Reset EP2 IN
-		USB_DEV_AD=0x00; scode=slen=config=0; USB_INT_FG=0xff; // Reset address and states
+		ep1_reset // Reset EP1 OUT
+		UEP2_CTRL=0x1e; UEP2_DMA=(uint16_t)buf_ep2[0]; UEP2_T_LEN=0; ret_len=idx_w_ep2=ep2_busy=ep2_pend=0; // Reset EP2 IN
+		USB_DEV_AD=0x00; scode=slen=config=0; stm_len=0; USB_INT_FG=0xff; // Reset address and states
 	}
 	else USB_INT_FG=0xff;
 }
@@ -282,17 +740,33 @@ void main(void)
 {
 	uint8_t rom;
 	uint8_t __xdata *buf;
-	uint8_t *len;
+	uint8_t __idata *len;
+	uint32_t tmr;
+	uint8_t rate[2];
 	SAFE_MOD=0x55; SAFE_MOD=0xaa; CLOCK_CFG=CLOCK_CFG&~0x07|0x05; SAFE_MOD=0x00; // Initialize clock at 16 MHz
 	pin_mode(P1, 0, 0, 0) pin_mode(P1, 1, 0, 0) pin_mode(P1, 4, 3, 1) pin_mode(P1, 5, 1, 0) pin_mode(P1, 6, 0, 0) pin_mode(P1, 7, 1, 0) // Initialize P1
 	pin_mode(P3, 0, 1, 1) pin_mode(P3, 1, 1, 1) pin_mode(P3, 2, 1, 1) pin_mode(P3, 3, 3, 1) pin_mode(P3, 4, 1, 1) // Initialize P3
 	//pin_mode(P1, 5, 1, 1) pin_mode(P1, 6, 3, 1)
+	for(rom=0;rom<sizeof(sta);rom++) ((uint8_t __xdata *)&sta)[rom]=0; // Clear performance counters
+	TMOD=TMOD&~0x0f|0x01; TH0=TL0=0; ET0=1; TR0=1; EA=1; // Start timer 0 free-running in 16-bit mode, power sequencing times it
+	rom_read(0x11, rate, 2); if(rate_ok(rate[0], rate[1])) rate_set(rate[0], rate[1]); else rate_set(2, 1); // Initialize SPI and bitbang at the calibrated rate, 8 MHz and default padding when unset
 	rom_read(0x00, &rom, 1); if(rom==0xff) {rom=0x0f; rom_write(0x00, &rom, 1);} ctl_write(0xff, 0x00, rom); // Populate control byte
-	SPI0_CK_SE=2; // Initialize SPI at 8 MHz
 	IE_USB=0; USB_CTRL=0x00; // Reset USB
 	UEP0_CTRL=0x02; UEP0_DMA=(uint16_t)buf_ep0; // Configure EP0 IN/OUT
-	UEP4_1_MOD=0x80; UEP1_CTRL=0x13; idx_r_ep1=1; UEP1_DMA=(uint16_t)buf_ep1_w; len_ep1_r=len_ep1_w=0; // Configure EP1 OUT
-	UEP2_3_MOD=0x04; UEP2_CTRL=0x1e; UEP2_DMA=(uint16_t)buf_ep2; UEP2_T_LEN=0; // Configure EP2 IN
+	UEP4_1_MOD=0x80; ep1_reset // Configure EP1 OUT
+	UEP2_3_MOD=0x04; UEP2_CTRL=0x1e; UEP2_DMA=(uint16_t)buf_ep2[0]; UEP2_T_LEN=0; idx_w_ep2=ep2_busy=ep2_pend=0; // Configure EP2 IN
 	USB_DEV_AD=0x00; UDEV_CTRL=0x08; USB_CTRL=0x29; UDEV_CTRL|=0x01; USB_INT_FG=0xff; USB_INT_EN=0x03; IE_USB=1; EA=1; // Initialize USB
-	while(1) {while(!len_ep1_r); EA=0; buf=buf_ep1_r; len=&len_ep1_r; EA=1; usb_parse(buf, *len); *len=0; UEP1_CTRL&=~0x08;} // Poll data and ACK on next request
+	while(1) // Poll data in ring order and free the slot, ACK resumes once a slot is free, count busy time and EP1 ring full
+	{
+		while(!len_ep1[idx_r_ep1] && !stm_abt);
+		if(stm_abt) // Abort, release NCS and drop stream state, queued packets and unsent responses
+		{
+			TMS=1; SPI0_CTRL=0x02; stm_len=0; stm_pg=0;
+			EA=0; ep1_drop UEP2_T_LEN=0; UEP2_CTRL|=0x02; ret_len=ret_bat=ep2_busy=ep2_pend=0; stm_abt=0; EA=1;
+			continue;
+		}
+		tmr=tmr_read(); EA=0; buf=buf_ep1[idx_r_ep1]; len=&len_ep1[idx_r_ep1]; if(len_ep1[idx_w_ep1]) sta.nak++; EA=1;
+		if(stm_len) {sta.raw++; stm_write(buf, *len);} else if(*buf==0x04) {sta.cmd[4]++; usb_batch(buf, *len);} else usb_parse(buf, *len);
+		EA=0; *len=0; idx_r_ep1=ep1_next(idx_r_ep1); UEP1_CTRL&=~0x08; EA=1; sta.busy+=tmr_read()-tmr;
+	}
 }
\ No newline at end of file
@@ -25,16 +25,295 @@
 const usb=require("usb");
 const util=require('util');
 const fs=require("fs");
+const os=require("os");
+const path=require("path");
+const crypto=require("crypto");
+const {Readable}=require("stream");
+const {pipeline}=require("stream/promises");
+
+// TAP state transitions for TMS 0 and 1
+const TAP={
+	RESET: ["IDLE", "RESET"], IDLE: ["IDLE", "DRSEL"],
+	DRSEL: ["DRCAP", "IRSEL"], DRCAP: ["DRSH", "DREX1"], DRSH: ["DRSH", "DREX1"], DREX1: ["DRPAU", "DRUPD"],
+	DRPAU: ["DRPAU", "DREX2"], DREX2: ["DRSH", "DRUPD"], DRUPD: ["IDLE", "DRSEL"],
+	IRSEL: ["IRCAP", "RESET"], IRCAP: ["IRSH", "IREX1"], IRSH: ["IRSH", "IREX1"], IREX1: ["IRPAU", "IRUPD"],
+	IRPAU: ["IRPAU", "IREX2"], IREX2: ["IRSH", "IRUPD"], IRUPD: ["IDLE", "DRSEL"],
+};
+
+// Shortest TMS paths between TAP states, filled on first use
+const TAP_PATH={};
+
+// Longest hard reset in ms, PWR_CFG_MS in usbjtag.c plus the PMU writes and the reset pulse
+const PWR_RST_MS=210;
+
+// Transaction builder, packs sub-commands into batch packets, opcode 0x04
+// IR and DR shifts track the TAP state, end in Exit1 and defer the move to Idle, so back-to-back shifts go from Update straight to the next Select
+// Pending TMS paths ride on the exit path of the previous scan or the entry path of the next one
+class UsbJtagBatch {
+	#jtag;
+	#cmds=[];
+	#state; // Tracked TAP state, null when unknown
+	#end=null; // Deferred end state after a shift
+	#pend=[]; // TMS path bits not yet clocked
+	#prev=null; // Last sub-command if it is a scan
+	#start; // TAP state before the first sub-command
+
+	constructor(jtag) {this.#jtag=jtag; this.#state=this.#start=jtag.tapState;}
+
+	// Add sub-command, len is the response length and fn converts the response, ms bounds the time the adapter may spend on it
+	raw(cmd, arg, dat=[], len=0, fn=null, ms=0) {
+		this.#settle();
+		this.#state=UsbJtag.tapCmd(this.#state, cmd, arg, dat);
+		return this.#push(cmd, arg, dat, len, fn, ms);
+	}
+
+	#push(cmd, arg, dat, len, fn, ms=0) {
+		if(dat.length>59 || len>64) throw("Error: invalid input length.");
+		this.#cmds.push({dat: [dat.length+2, cmd, arg, ...dat], len, fn, ms});
+		this.#prev=null;
+		return this;
+	}
+
+	// Clock pending path bits, the previous scan exit path takes what fits and path-only scans take the rest
+	// Returns the bits left for an entry path of up to room bits
+	#flush(room=0) {
+		const p=this.#prev, b=this.#pend;
+		this.#pend=[];
+		if(p && p.ext[1]<8 && b.length) { // Exit path starts on the final data bit, keep its TMS low
+			if(p.bits && !p.ext[1]) p.ext=[0, 1];
+			const n=Math.min(8-p.ext[1], b.length);
+			for(let i=0;i<n;i++) p.ext[0]|=b[i]<<p.ext[1]++;
+			p.cmd.dat.splice(3, 3, ...UsbJtag.scanData([], 0, p.ent, p.ext, false).slice(0, 3));
+			b.splice(0, n);
+		}
+		while(b.length>room) {const n=Math.min(8, b.length-room); this.#scan([], 0, [b.slice(0, n).reduce((t, v, i)=> t|v<<i, 0), n], [0, 0], false, null); b.splice(0, n);}
+		return b;
+	}
+
+	// Add scan, pending path bits are clocked first
+	#scan(tdi, bits, ent, ext, read, fn) {
+		const b=this.#flush(8-ent[1]);
+		ent=[b.reduce((t, v, i)=> t|v<<i, 0)|ent[0]<<b.length, b.length+ent[1]];
+		const dat=UsbJtag.scanData(tdi, bits, ent, ext, read);
+		this.#push(0x01, read?0x05:0x04, dat, read?(bits+7)>>3:0, fn);
+		this.#prev={cmd: this.#cmds[this.#cmds.length-1], bits, ent, ext: [...ext]};
+		return this;
+	}
+
+	// Move to the deferred end state and clock pending path bits
+	#settle() {
+		if(this.#end) {this.#goto(this.#end); this.#end=null;}
+		this.#flush();
+	}
+
+	// Queue shortest path to state, through Update after a shift and from Reset when the state is unknown
+	#goto(state) {
+		if(!this.#state) {this.#pend.push(1, 1, 1, 1, 1); this.#state="RESET";}
+		if(this.#state=="IREX1" || this.#state=="DREX1") {this.#pend.push(1); this.#state=TAP[this.#state][1];}
+		this.#pend.push(...UsbJtag.tapPath(this.#state, state));
+		this.#state=state;
+	}
+
+	// Move TAP to state, skipping the deferred end state
+	goto(state) {
+		if(!TAP[state]) throw("Error: invalid TAP state.");
+		this.#end=null;
+		this.#goto(state);
+		return this;
+	}
+
+	// Shift IR or DR from any state, ends in Exit1 with Idle deferred, optionally read TDO
+	shift(ir, tdi, bits, read=false, fn=null) {
+		this.goto(ir?"IRSH":"DRSH");
+		this.#scan(tdi, bits, [0, 0], [1, 1], read, fn);
+		this.#state=ir?"IREX1":"DREX1"; this.#end="IDLE";
+		return this;
+	}
+
+	// Go to Idle and clock it n times
+	idle(n=0) {
+		this.goto("IDLE");
+		for(let i=0;i<n;i++) this.#pend.push(0);
+		return this;
+	}
+
+	// Hard reset FPGA, the adapter waits for configuration so its response may come up to PWR_RST_MS later
+	rstPwr() {return this.raw(0x00, 0x00, [0x00], 0, null, PWR_RST_MS);}
+
+	// User reset FPGA
+	rstUsr() {return this.raw(0x00, 0x00, [0x01]);}
+
+	// Read power sequencing phase times of the last power change or hard reset, see UsbJtag.pwrTimes
+	readPwr() {return this.raw(0x00, 0x09, [], 13, (r)=> UsbJtag.pwrTimes(Buffer.from(r)));}
+
+	// Delay ms plus us
+	delay(ms, us=0) {
+		if(ms<0 || ms>255 || us<0 || us>255) throw("Error: value out of bound.");
+		return this.raw(0x00, 0x04, [0x00, ms, us], 0, null, ms+1);
+	}
+
+	// Pulse TCK for ms plus us
+	pulse(ms, us=0) {
+		if(ms<0 || ms>255 || us<0 || us>255) throw("Error: value out of bound.");
+		return this.raw(0x00, 0x04, [0x01, ms, us], 0, null, ms+1);
+	}
+
+	// Set SPI clock divider and bitbang padding
+	rate(div, pad) {
+		if(div<2 || div>64 || pad<0 || pad>64) throw("Error: value out of bound.");
+		return this.raw(0x00, 0x08, [0x00, div, pad]);
+	}
+
+	// Read error status
+	readErr() {return this.raw(0x00, 0x05, [], 1, (r)=> r[0]);}
+
+	// Reset TAP, skipped when the tracked state is Reset unless forced
+	rstTap(force=false) {
+		if(force || !this.#state) {this.#end=null; this.#pend.push(1, 1, 1, 1, 1); this.#state="RESET";}
+		else this.goto("RESET");
+		return this;
+	}
+
+	// SPI write, NCS released at the end
+	spiWrite(dat) {return this.raw(0x02, 0x00, dat);}
+
+	// SPI flash wait for WIP clear, up to ms milliseconds, sets error status on timeout
+	spiWait(ms) {
+		if(ms<0 || ms>65535) throw("Error: value out of bound.");
+		return this.raw(0x02, 0x02, [ms&0xff, ms>>8], 0, null, ms);
+	}
+
+	// JTAG scan bits with explicit paths from the current TAP state, see UsbJtag.fpgaScanJtag
+	scan(tdi, bits, ent=[0, 0], ext=[0, 0], read=false, fn=null) {
+		this.#settle();
+		this.#state=UsbJtag.tapCmd(this.#state, 0x01, 0x04, UsbJtag.scanData(tdi, bits, ent, ext, false));
+		return this.#scan(tdi, bits, ent, ext, read, fn);
+	}
+
+	// Send JTAG command
+	cmd(cmd) {return this.shift(true, [cmd&0xff], 8);}
+
+	// Read JTAG register
+	readReg(reg, fn=(r)=> r) {return this.cmd(reg).shift(false, [0x00, 0x00, 0x00, 0x00], 32, true, (r)=> fn(Buffer.from(r).reverse()));}
+
+	// Read FPGA ID
+	readId() {return this.readReg(0x11, (r)=> Array.from(r, (b)=> {return ("0"+b.toString(16)).slice(-2);}).join(""));}
+
+	// Read FPGA CDONE status
+	readCdn() {return this.readReg(0x41, (r)=> (r[2]&0x20)?true:false);}
+
+	// FPGA reset SRAM
+	rstSram() {return this.cmd(0x15).cmd(0x05).cmd(0x02).delay(10).cmd(0x09).cmd(0x3a).cmd(0x02);}
+
+	// Merge runs of write-only scans into bitbang sub-commands when that is shorter
+	// Bitbang clocks whole bytes, the run is padded with TMS low clocks where the TAP holds, Idle or Pause before or after it
+	#pack() {
+		const out=[], hold=(s)=> s=="IDLE" || s=="DRPAU" || s=="IRPAU";
+		let st=this.#start, s0=null, run=[];
+		const end=()=> {
+			const tms=[], tdi=[];
+			for(const c of run) {const b=UsbJtag.scanBits(c.dat.slice(3)); tms.push(...b.tms); tdi.push(...b.tdi);}
+			const pad=new Array(-tms.length&7).fill(0);
+			if(pad.length && hold(s0)) {tms.unshift(...pad); tdi.unshift(...pad);}
+			else if(pad.length && hold(st)) {tms.push(...pad); tdi.push(...pad);}
+			const n=tms.length>>3, size=n*2+Math.ceil(n/29)*3;
+			if(run.length<2 || tms.length&7 || size>=run.reduce((t, c)=> t+c.dat.length, 0)) {out.push(...run); run=[]; return;}
+			const byte=(b, i)=> b.slice(i*8, i*8+8).reduce((t, v, j)=> t|v<<j, 0);
+			for(let i=0;i<n;i+=29) {
+				const k=Math.min(29, n-i), m=Array.from({length: k}, (_, j)=> byte(tms, i+j)), d=Array.from({length: k}, (_, j)=> byte(tdi, i+j));
+				out.push({dat: [k*2+2, 0x01, 0x00, ...m, ...d], len: 0, fn: null});
+			}
+			run=[];
+		};
+		for(const c of this.#cmds) {
+			if(c.dat[1]==0x01 && c.dat[2]==0x04) {if(!run.length) s0=st; run.push(c);}
+			else {end(); out.push(c);}
+			st=UsbJtag.tapCmd(st, c.dat[1], c.dat[2], c.dat.slice(3));
+		}
+		end();
+		return out;
+	}
+
+	// Pack sub-commands into as few packets as possible, each response fits in one EP2 IN packet
+	*packets() {
+		let grp={dat: [0x04, 0x00], len: 0, ms: 0, cmds: []};
+		for(const c of this.#pack()) {
+			if(grp.dat.length+c.dat.length>64 || grp.len+c.len>64) {yield grp; grp={dat: [0x04, 0x00], len: 0, ms: 0, cmds: []};}
+			grp.dat.push(...c.dat); grp.len+=c.len; grp.ms+=c.ms||0; grp.cmds.push(c);
+		}
+		if(grp.cmds.length) yield grp;
+	}
+
+	// Settle the TAP and take the packets built so far, the tracked state moves on to the adapter
+	build() {
+		this.#settle();
+		this.#jtag.tapState=this.#state;
+		const grps=[...this.packets()];
+		this.#cmds=[]; this.#prev=null; this.#start=this.#state;
+		return grps;
+	}
+
+	// Send all packets pipelined, collect responses in order, the TAP ends in a stable state
+	// A response behind long adapter time, waits and flash polls since the previous response, is read alone with a timeout of twice that
+	async exec() {
+		const grps=this.build();
+		const ret=[];
+		const rd=async ()=> {
+			const ins=[], wait=[];
+			let ms=0;
+			for(const g of grps) {ms+=g.ms; if(g.len) {ins.push(g); wait.push(ms>=50?ms*2+100:0); ms=0;}}
+			let k=0;
+			for await(const r of this.#jtag.usbReadPipe(ins.length, this.#jtag.readDepth, wait)) {
+				const g=ins[k++];
+				if(r.length!=g.len) throw("Error: invalid response length.");
+				let ofs=0;
+				for(const c of g.cmds) if(c.len) {const v=r.subarray(ofs, ofs+c.len); ofs+=c.len; ret.push(c.fn?c.fn(v):v);}
+			}
+		};
+		const res=await Promise.allSettled([this.#jtag.usbWritePipe(grps.map((g)=> Buffer.from(g.dat))), rd()]);
+		for(const r of res) if(r.status=="rejected") {this.#jtag.tapState=null; throw(r.reason);}
+		return ret;
+	}
+}
 
 class UsbJtag {
 	// Private members
 	#rx;
 	#tx;
+	#drain=null; // Abandoned capture being stopped and drained, later transfers wait for it
+
+	// Write pipeline settings, bulk transfers in flight and packets per transfer
+	pipeDepth=4;
+	pipeGroup=16;
+
+	// Bulk IN transfers kept posted while reading responses
+	readDepth=4;
+
+	// Compress SRAM bitstreams on the wire, chunks that do not shrink below rleRatio are sent raw
+	rle=true;
+	rleRatio=0.97;
+
+	// Packed .fs bitstream cache directory
+	fsCache=process.env.USBJTAG_CACHE||path.join(os.homedir(), ".cache", "usbjtag");
+
+	// Serial number, set by openAll
+	sn="";
 
-	// Find and open device, initialize endpoints
-	async open() {
+	// Tracked TAP state, null when unknown
+	tapState=null;
+
+	// Find and open device, initialize endpoints, dev selects a USB device, a serial number, or an emulated device from usbemu.js
+	async open(dev=null) {
+		this.tapState=null;
+		if(dev && dev.tx) {this.dev=dev; this.rx=dev.rx.bind(dev); this.tx=dev.tx.bind(dev); this.tapState=dev.tapState||null; return;} // A daemon session carries the TAP state it was left in
+		if(typeof dev=="string") { // Open each adapter until the serial number matches
+			for(const d of UsbJtag.devices()) {
+				try {await this.open(d); if(await this.mcuReadSn()==dev) {this.sn=dev; return;} this.close();} catch(e) {;}
+			}
+			throw(`Error: cannot find USB device ${dev}.`);
+		}
 		// Find device
-		this.dev=usb.findByIds(0x20a0, 0x4209);
+		this.dev=dev||usb.findByIds(0x20a0, 0x4209);
 		if(!this.dev) throw("Error: cannot find USB device.");
 		// Open and configure device
 		try {
@@ -49,18 +328,171 @@ class UsbJtag {
 			this.tx=util.promisify(txe.transfer).bind(txe);
 		}
 		catch(e) {throw("Error: failed to open USB device.");}
+		// Abort a stream or capture left by a previous session, the adapter drops queued packets and unsent responses
+		// Firmware that stalls the request predates the streaming opcodes the host uses, stale flags it until usbjtag.bin is rebuilt and flashed
+		const ctl=util.promisify(this.dev.controlTransfer).bind(this.dev);
+		let pend=0;
+		this.stale=false;
+		try {
+			await ctl(0x40, 0x01, 0, 0, Buffer.alloc(0));
+			for(let i=0;i<50 && (pend=(await ctl(0xc0, 0x02, 0, 0, 1))[0]);i++) await new Promise((res)=> setTimeout(res, 10));
+		}
+		catch(e) {this.stale=/STALL|PIPE/.test(e.message);}
+		if(pend) throw("Error: adapter did not finish the abort.");
 		// Flush input buffer
 		try {await this.rx(64);} catch(e) {;}
 	}
 
 	// Close device
-	close() {this.dev.close();}
+	close() {return this.dev.close();}
+
+	// List attached adapters
+	static devices() {return usb.getDeviceList().filter((d)=> d.deviceDescriptor.idVendor==0x20a0 && d.deviceDescriptor.idProduct==0x4209);}
+
+	// Open adapters, USB devices or emulated devices, and read their serial numbers, adapters that fail to open are skipped
+	static async openAll(devs=UsbJtag.devices()) {
+		const ret=[];
+		for(const d of devs) {
+			const jtag=new UsbJtag;
+			try {await jtag.open(d); jtag.sn=await jtag.mcuReadSn(); ret.push(jtag);} catch(e) {;}
+		}
+		return ret;
+	}
+
+	// Run fn(jtag, i) on adapters concurrently, up to limit at a time, each adapter keeps its own pipeline
+	// Resolves with {sn, ret, err, ms} per adapter in input order, a failing or slow adapter does not stop the others
+	static async runAll(jtags, fn, limit=jtags.length) {
+		const res=new Array(jtags.length);
+		let next=0;
+		const worker=async ()=> {
+			while(next<jtags.length) {
+				const i=next++, t=process.hrtime();
+				try {res[i]={sn: jtags[i].sn, ret: await fn(jtags[i], i)};} catch(e) {res[i]={sn: jtags[i].sn, err: e};}
+				const d=process.hrtime(t);
+				res[i].ms=d[0]*1000+d[1]/1000000;
+			}
+		};
+		await Promise.all(Array.from({length: Math.min(limit, jtags.length)}, worker));
+		return res;
+	}
 
 	// Read bytes from device
-	async usbRead() {return await this.rx(64);}
+	async usbRead() {if(this.#drain) await this.#drain; return await this.rx(64);}
+
+	// Read from device, retrying timeouts until ms have passed, for responses that follow long device delays
+	// Each timeout is 100 ms of the transport's own clock, so the emulator bounds it in virtual time
+	async usbReadWait(ms) {
+		for(let t=0;;t+=100) {
+			try {return await this.usbRead();}
+			catch(e) {if(!/TIMED_OUT/.test(e.message) || t+100>=ms) throw(e);}
+		}
+	}
+
+	// Read n packets from device in order, keeping up to depth bulk transfers posted
+	// Packets with a wait in ms are read alone, so a retried timeout cannot reorder responses
+	async *usbReadPipe(n, depth=this.readDepth, wait=[]) {
+		const q=[];
+		for(let i=0, k=0;i<n || q.length;k++) {
+			while(i<n && q.length<depth && !(q.length && (wait[i] || wait[k]))) {const p=wait[i]?this.usbReadWait(wait[i]):this.usbRead(); p.catch(()=> {;}); q.push(p); i++;}
+			yield await q.shift();
+		}
+	}
 
 	// Write bytes to device
-	async usbWrite(cmd, arg, dat=[]) {return await this.tx([cmd, arg, ...dat]);}
+	async usbWrite(cmd, arg, dat=[]) {
+		if(this.#drain) await this.#drain;
+		this.tapState=UsbJtag.tapCmd(this.tapState, cmd, arg, dat);
+		return await this.tx([cmd, arg, ...dat]);
+	}
+
+	// Split payload into packets of one command
+	*usbPackets(cmd, arg, buf) {
+		for(let i=0;i<buf.length;i+=62) yield Buffer.from([cmd, arg, ...buf.subarray(i, i+62)]);
+	}
+
+	// Write packets to device, keeping up to pipeDepth bulk transfers in flight
+	// Full packets are merged into multi-packet transfers, a short packet ends a transfer
+	async usbWritePipe(pkts, depth=this.pipeDepth, group=this.pipeGroup) {
+		if(this.#drain) await this.#drain;
+		const pend=new Set();
+		let err=null, cur=[];
+		const submit=()=> {
+			const p=this.tx(cur.length==1?cur[0]:Buffer.concat(cur)).then(()=> {pend.delete(p);}, (e)=> {pend.delete(p); if(!err) err=e;});
+			pend.add(p); cur=[];
+		};
+		for await(const pkt of pkts) {
+			cur.push(pkt);
+			if(pkt.length<64 || cur.length>=group) submit();
+			while(pend.size>=depth && !err) await Promise.race(pend); // Backpressure
+			if(err) break;
+		}
+		if(cur.length && !err) submit();
+		await Promise.all(pend);
+		if(err) throw(err);
+	}
+
+	// Split stream into header packet and raw data packets, opcode 0x03, ext holds sink specific header bytes
+	*usbStream(sink, buf, ext=[]) {
+		this.tapState=UsbJtag.tapCmd(this.tapState, 0x03, sink, [0, 0, 0, 0, ...ext]);
+		const hdr=Buffer.from([0x03, sink, 0, 0, 0, 0, ...ext]);
+		hdr.writeUInt32LE(buf.length, 2);
+		const n=64-hdr.length;
+		yield Buffer.concat([hdr, buf.subarray(0, n)]);
+		for(let i=n;i<buf.length;i+=64) yield buf.subarray(i, i+64);
+	}
+
+	// Compress into whole-token packets for stream sink 0x04, the header packet has 6 bytes less room
+	// Literal [n-1, bytes] for n up to 128, run [0x80+n-2, byte] for n from 2 to 128, long run [0xff, n, byte] with a 16-bit count
+	static rlePackets(buf) {
+		const pkts=[];
+		let cur=[], cap=58, lit=0;
+		const room=()=> cap-cur.length;
+		const close=()=> {pkts.push(cur); cur=[]; cap=64;};
+		const flush=(end)=> { // Literals up to end
+			while(lit<end) {
+				if(room()<2) close();
+				const n=Math.min(128, end-lit, room()-1);
+				cur.push(n-1, ...buf.subarray(lit, lit+n)); lit+=n;
+			}
+		};
+		for(let i=0;i<buf.length;) {
+			let j=i+1;
+			while(j<buf.length && buf[j]==buf[i] && j-i<65535) j++;
+			if(j-i<3) {i=j; continue;} // Short repeats stay literal
+			flush(i);
+			for(let n=j-i;n;) {
+				if(room()<2) close();
+				const k=n>128 && room()>=4?n:n<=128?n:n<130?n-2:128; // Runs split off a long one leave at least 2, a 1-byte run would read as a literal
+				if(k>128) cur.push(0xff, k&0xff, k>>8, buf[i]); else cur.push(0x7e+k, buf[i]);
+				n-=k;
+			}
+			i=lit=j;
+		}
+		flush(buf.length);
+		if(cur.length) close();
+		return pkts;
+	}
+
+	// Split compressed stream into header packet and whole-token packets, opcode 0x03, 0x04
+	*usbRle(pkts) {
+		const hdr=Buffer.from([0x03, 0x04, 0, 0, 0, 0]);
+		hdr.writeUInt32LE(pkts.reduce((n, p)=> n+p.length, 0), 2);
+		yield Buffer.concat([hdr, Buffer.from(pkts[0])]);
+		for(let i=1;i<pkts.length;i++) yield Buffer.from(pkts[i]);
+	}
+
+	// JTAG stream write, compressed where it pays off, falls back to raw stream otherwise
+	*usbJtagStream(buf) {
+		if(this.rle && buf.length) {
+			const pkts=UsbJtag.rlePackets(buf);
+			const n=pkts.reduce((n, p)=> n+p.length, 0);
+			if(n<buf.length*this.rleRatio) {yield* this.usbRle(pkts); return;}
+		}
+		yield* this.usbStream(0x01, buf);
+	}
+
+	// Start a transaction of batched sub-commands
+	batch() {return new UsbJtagBatch(this);}
 
 	// Write bytes to then read bytes from device
 	async usbCall(cmd, arg, dat=[], len=-1) {
@@ -70,8 +502,8 @@ class UsbJtag {
 		return ret;
 	}
 
-	// Hard reset FPGA, opcode 0x00, 0x00, 0x00
-	async fpgaRstPwr() {await this.usbWrite(0x00, 0x00, [0x00]);}
+	// Hard reset FPGA and read its phase times in the same round trip, opcode 0x00, 0x00, 0x00
+	async fpgaRstPwr() {return (await this.batch().rstPwr().readPwr().exec())[0];}
 
 	// User reset FPGA, opcode 0x00, 0x00, 0x01
 	async fpgaRstUsr() {await this.usbWrite(0x00, 0x00, [0x01]);}
@@ -100,6 +532,29 @@ class UsbJtag {
 	// Read error status, opcode 0x00, 0x05
 	async mcuReadErr() {return (await this.usbCall(0x00, 0x05, [], 1))[0];}
 
+	// Read performance counters, opcode 0x00, 0x06, busy time is converted from Fsys/12 timer ticks to ms
+	async mcuReadStats(clear=false) {
+		const r=await this.usbCall(0x00, 0x06, [clear?0x01:0x00], 44);
+		const v=Array.from({length: 11}, (_, i)=> r.readUInt32LE(i*4));
+		return {cmd: {ctl: v[0], jtag: v[1], spi: v[2], stream: v[3], batch: v[4]}, raw: v[5], bits: v[6], spi: v[7], nak: v[8], spin: v[9], busy: v[10]*12/16000};
+	}
+
+	// Read power sequencing phase times of the last power change or hard reset, opcode 0x00, 0x09
+	async mcuReadPwr() {return UsbJtag.pwrTimes(await this.usbCall(0x00, 0x09, [], 13));}
+
+	// Read SPI clock divider and bitbang padding, SPI runs at 16 MHz over the divider, opcode 0x00, 0x07
+	async mcuReadRate(rom) {
+		const r=await this.usbCall(0x00, 0x07, [rom?0x01:0x00], 2);
+		return {div: r[0], pad: r[1]};
+	}
+
+	// Write SPI clock divider 2-64 and bitbang padding 0-64, the data flash copy is applied at power up, opcode 0x00, 0x08
+	async mcuWriteRate(div, pad, rom) {
+		if(div<2 || div>64 || pad<0 || pad>64) throw("Error: value out of bound.");
+		if(rom) await this.usbWrite(0x00, 0x08, [0x01, div, pad]);
+		await this.usbWrite(0x00, 0x08, [0x00, div, pad]);
+	}
+
 	// Read serial number, opcode 0x00, 0xfd
 	async mcuReadSn() {return String.fromCharCode.apply(null, await this.usbCall(0x00, 0xfd, [], 16)).replace(/\0/g, "");}
 
@@ -136,12 +591,186 @@ class UsbJtag {
 		}
 	}
 
+	// JTAG scan bits with TMS low, opcode 0x01, 0x04/0x05
+	// Paths are [tms, count] clocked LSB first, exit path starts on the final data bit, reads return TDO of data bits
+	async fpgaScanJtag(tdi, bits, ent=[0, 0], ext=[0, 0], read=false) {
+		const dat=UsbJtag.scanData(tdi, bits, ent, ext, read);
+		if(read) return await this.usbCall(0x01, 0x05, dat, (bits+7)>>3);
+		await this.usbWrite(0x01, 0x04, dat);
+	}
+
+	// Build JTAG scan payload
+	static scanData(tdi, bits, ent, ext, read) {
+		const len=(bits+7)>>3;
+		if(bits<0 || bits>464 || tdi.length<len || (read && !bits) || ent[1]>8 || ext[1]>8) throw("Error: invalid input length.");
+		return [ent[1]<<4|ext[1], ent[0]&0xff, ext[0]&0xff, bits-((len-1)<<3), ...Array.from(tdi).slice(0, len)];
+	}
+
+	// Power sequencing phase times in ms, power off until Vbus settles without the rail load, power on until Vbus settles and configuration until the FPGA is ready
+	// Phases that ran into their firmware timeout are listed in timeout
+	static pwrTimes(r) {
+		const names=["off", "rail", "cfg"], ret={timeout: names.filter((_, i)=> r[12]>>i&1)};
+		names.forEach((n, i)=> ret[n]=r.readUInt32LE(i*4)/1000);
+		return ret;
+	}
+
+	// TAP state names
+	static tapStates() {return Object.keys(TAP);}
+
+	// Next TAP state after one TCK with tms
+	static tapNext(state, tms) {return TAP[state][tms?1:0];}
+
+	// TAP state after clocking TMS bits, an unknown state becomes Reset after 5 TMS high clocks
+	static tapWalk(state, tms) {
+		let ones=0;
+		for(const m of tms) {ones=m?ones+1:0; state=state?TAP[state][m?1:0]:(ones>=5?"RESET":null);}
+		return state;
+	}
+
+	// TMS and TDI clocks of a scan payload, paths clock TDI low
+	static scanBits(dat) {
+		const bits=(v, n)=> Array.from({length: n}, (_, i)=> v>>i&1);
+		const ent=dat[0]>>4, ext=dat[0]&0x0f, n=dat.length>4?(dat.length-5)*8+dat[3]:0;
+		const tms=bits(dat[1], ent), tdi=new Array(ent).fill(0);
+		for(let i=0;i<n;i++) {tms.push(i==n-1 && ext?dat[2]&1:0); tdi.push(dat[4+(i>>3)]>>(i&7)&1);}
+		const p=n && ext?bits(dat[2]>>1, ext-1):bits(dat[2], ext);
+		tms.push(...p); tdi.push(...p.map(()=> 0));
+		return {tms, tdi};
+	}
+
+	// Shortest TMS path between TAP states, breadth-first over the state graph
+	static tapPath(from, to) {
+		if(!TAP_PATH[from]) {
+			const p={[from]: []}, q=[from];
+			while(q.length) {const s=q.shift(); for(const m of [0, 1]) {const n=TAP[s][m]; if(!p[n]) {p[n]=[...p[s], m]; q.push(n);}}}
+			TAP_PATH[from]=p;
+		}
+		return TAP_PATH[from][to];
+	}
+
+	// TAP state after a command, SPI, power and control commands leave it unknown
+	static tapCmd(state, cmd, arg, dat) {
+		const bits=(v, n)=> Array.from({length: n}, (_, i)=> v>>i&1);
+		const low=(n)=> new Array(Math.min(n, 8)).fill(0);
+		if(cmd==0x00) return arg==0x00 || arg==0x02 || arg==0xff?null:arg==0x04 && dat[0]==0x01?UsbJtag.tapWalk(state, low(8)):state;
+		if(cmd==0x01 && arg<=0x01) return UsbJtag.tapWalk(state, Array.from(dat.slice(0, dat.length>>1)).flatMap((m)=> bits(m, 8)));
+		if(cmd==0x01 && arg<=0x03) return UsbJtag.tapWalk(state, low(dat.length*8));
+		if(cmd==0x01 && arg<=0x05) return UsbJtag.tapWalk(state, UsbJtag.scanBits(dat).tms);
+		if(cmd==0x03 && arg==0x81) return UsbJtag.tapWalk(state, UsbJtag.scanBits(dat.slice(4)).tms)===state?state:null; // Repeated scan that returns to its start state
+		if(cmd==0x03) return arg==0x01 || arg==0x04 || (arg==0x03 && dat[4]&0x01)?UsbJtag.tapWalk(state, low(8)):arg==0x80 || arg==0x83?state:null;
+		return cmd==0x02?null:state;
+	}
+
+	// Shift IR, paths planned from the tracked TAP state
+	async shiftIr(ir, bits=8) {await this.batch().shift(true, [ir], bits).exec();}
+
+	// Shift DR, paths planned from the tracked TAP state, optionally read TDO
+	async shiftDr(tdi, bits, read=false) {return (await this.batch().shift(false, tdi, bits, read).exec())[0];}
+
 	// JTAG pulse TCK, opcode 0x00, 0x04, 0x01
 	async fpgaPulseJtag(ms, us) {
 		if(ms<0 || ms>255 || us<0 || us>255) throw("Error: value out of bound.");
 		await this.usbWrite(0x00, 0x04, [0x01, ms, us]);
 	}
 
+	// Stream write, opcode 0x03, sink 0x00 for SPI with NCS held low, 0x01 for JTAG with TMS low
+	async streamWrite(buf, sink=0x01) {
+		if(sink<0 || sink>1 || buf.length>0xffffffff) throw("Error: invalid input.");
+		await this.usbWritePipe(this.usbStream(sink, Buffer.from(buf)));
+	}
+
+	// Verify stream, opcode 0x03, 0x03 then 0x03, 0x80, shifts TDI and returns TDO CRC and first mismatch offset, -1 if none
+	// tdi, exp and mask are optional buffers of len bytes, missing TDI shifts 0xff, missing mask compares all bits
+	// pre is shifted first with TDO unchecked, SPI holds NCS low for the whole stream
+	async streamVerify(len, opt={}) {
+		await this.usbWritePipe(this.usbVerify(len, opt));
+		const ret=await this.usbCall(0x03, 0x80, [], 6);
+		const bad=ret.readUInt32LE(2);
+		return {crc: ret.readUInt16LE(0), bad: bad==0xffffffff?-1:bad};
+	}
+
+	// Split verify stream into packets, records interleave the TDI, expected and mask fields present
+	*usbVerify(len, {tdi=null, exp=null, mask=null, jtag=true, pre=[]}={}) {
+		if(!tdi && !exp) tdi=Buffer.alloc(len, 0xff);
+		const flds=[tdi, exp, mask].filter((f)=> f);
+		if(flds.some((f)=> f.length<len) || (mask && !exp) || pre.length>52) throw("Error: invalid input length.");
+		const mode=(jtag?0x01:0x00)|(tdi?0x02:0x00)|(exp?0x04:0x00)|(mask?0x08:0x00);
+		const rec=Buffer.alloc(len*flds.length);
+		for(let i=0, k=0;i<len;i++) for(const f of flds) rec[k++]=f[i];
+		yield* this.usbStream(0x03, rec, [mode, pre.length, ...pre]);
+	}
+
+	// CRC-16/CCITT as computed by the verify stream
+	static crc16(buf, crc=0xffff) {
+		for(const b of buf) {
+			let x=(crc>>8^b)&0xff;
+			x^=x>>4;
+			crc=(crc<<8^x<<12^x<<5^x)&0xffff;
+		}
+		return crc;
+	}
+
+	// Capture stream, opcode 0x03, 0x81 repeats a JTAG scan and 0x82 an SPI transaction, count 0 runs until stop()
+	// The device pushes packets of whole n-byte samples as fast as they are read, a zero-length packet ends the capture
+	// Returns a readable byte stream with stop(), a counted capture posts no reads past its zero-length packet
+	// Readback 0x84 and sector CRCs 0x85 push the same way, hdr replaces the sample count for the latter
+	// wait in ms bounds a packet that takes the device longer than the read timeout to fill, its reads retry and go one at a time
+	usbCapture(arg, dat, n, count=0, hdr=[count&0xff, count>>8&0xff, count>>16&0xff, count>>>24], wait=0) {
+		if(n<1 || n>64 || count<0 || count>0xffffffff) throw("Error: invalid input.");
+		const self=this;
+		let stopped=false;
+		let left=count?Math.ceil(count/Math.floor(64/n))+1:Infinity; // Packets of whole samples then the zero-length packet
+		const gen=async function*() {
+			await self.usbWrite(0x03, arg, [...hdr, ...dat]);
+			const q=[], post=()=> {if(left) {const p=wait?self.usbReadWait(wait):self.usbRead(); p.catch(()=> {;}); q.push(p); left--;}};
+			for(let i=0;i<(wait?1:self.readDepth);i++) post();
+			let done=false;
+			try {
+				while(q.length) {
+					const r=await q.shift();
+					if(!r.length) {done=true; break;}
+					post();
+					yield r;
+				}
+			}
+			finally {
+				if(!done) { // Abandoned stream, stop the capture and drain up to its zero-length packet so later responses are not stale samples
+					if(!stopped) {stopped=true; try {await self.tx([0x03, 0x83]);} catch(e) {;}}
+					for(let i=0, t=0;i<16 && !done;i++) {
+						try {done=!(await (q.length?q.shift():self.rx(64))).length;}
+						catch(e) {if(!/TIMED_OUT/.test(e.message) || (t+=100)>=wait) break; i--;}
+					}
+				}
+				await Promise.allSettled(q); // Reads posted past a stopped capture time out
+			}
+		};
+		const s=Readable.from(gen(), {objectMode: false});
+		s.sampleSize=n;
+		s.stop=async ()=> {if(!stopped) {stopped=true; await self.usbWrite(0x03, 0x83);}};
+		const destroy=s._destroy; // A for await break does not wait for the generator cleanup
+		s._destroy=(err, cb)=> {
+			const p=new Promise((res)=> destroy.call(s, err, (e)=> {res(); cb(e);}));
+			const d=p.then(()=> {if(self.#drain===d) self.#drain=null;});
+			self.#drain=d;
+		};
+		return s;
+	}
+
+	// Capture DR samples of bits each, IR is shifted once and every sample is a read scan from Idle through Capture-DR back to Idle
+	async fpgaCapture(ir, bits, {count=0, irBits=8, tdi=[]}={}) {
+		const len=(bits+7)>>3, pack=(p)=> [p.reduce((t, v, i)=> t|v<<i, 0), p.length];
+		if(bits<1 || len>54 || tdi.length>len) throw("Error: invalid input length.");
+		const dat=UsbJtag.scanData([...tdi, ...new Array(len-tdi.length).fill(0)], bits, pack(UsbJtag.tapPath("IDLE", "DRSH")), pack([1, ...UsbJtag.tapPath("DREX1", "IDLE")]), true);
+		await this.batch().shift(true, [ir], irBits).idle().exec();
+		return this.usbCapture(0x81, dat, len, count);
+	}
+
+	// Capture SPI samples, each is one transaction of tx with NCS toggled around it, returns the bytes read
+	captureSpi(tx, {count=0}={}) {
+		if(tx.length<1 || tx.length>58) throw("Error: invalid input length.");
+		return this.usbCapture(0x82, Array.from(tx), tx.length, count);
+	}
+
 	// SPI write, opcode 0x02, 0x00
 	async fpgaWriteSpi(dat) {
 		if(dat.length<1 || dat.length>62) throw("Error: invalid input length.");
@@ -154,57 +783,248 @@ class UsbJtag {
 		return await this.usbCall(0x02, 0x01, dat, dat.length);
 	}
 
+	// SPI flash readback stream of len bytes from address, the device clocks the dummy bytes itself, opcode 0x03, 0x84
+	flashStream(adr, len) {
+		if(adr<0 || adr>0xffffff || len<0 || len>0xffffffff) throw("Error: value out of bound.");
+		if(!len) return Readable.from([]); // A count of 0 would run until stopped
+		return this.usbCapture(0x84, [0x03, adr>>16&0xff, adr>>8&0xff, adr&0xff], 1, len);
+	}
+
+	// SPI flash read len bytes from address
+	async flashRead(adr, len) {
+		const bufs=[];
+		for await(const b of this.flashStream(adr, len)) bufs.push(b);
+		return Buffer.concat(bufs);
+	}
+
+	// SPI flash read len bytes from address into a file, memory stays bounded by the posted reads
+	async flashReadFile(filename, adr, len) {
+		await pipeline(this.flashStream(adr, len), fs.createWriteStream(filename));
+		return len;
+	}
+
+	// SPI flash CRC-16/CCITT of cnt sectors of 2^shift bytes from address, computed on the device, opcode 0x03, 0x85
+	// A packet holds up to 32 CRCs, its reads wait for them at up to 32 us per byte, the slowest SPI divider
+	async flashCrcs(adr, cnt, shift=12) {
+		if(adr<0 || adr>0xffffff || cnt<0 || cnt>0xffff || shift<8 || shift>16) throw("Error: value out of bound.");
+		if(!cnt) return [];
+		const bufs=[], wait=Math.ceil(Math.min(cnt, 32)*(1<<shift)*0.032)+100;
+		for await(const b of this.usbCapture(0x85, [], 2, cnt, [adr&0xff, adr>>8&0xff, adr>>16&0xff, 0x00, cnt&0xff, cnt>>8, shift], wait)) bufs.push(b);
+		const r=Buffer.concat(bufs);
+		if(r.length!=cnt*2) throw("Error: invalid response length.");
+		return Array.from({length: cnt}, (_, i)=> r.readUInt16LE(i*2));
+	}
+
+	// Flags the 4 KiB sectors of an image from sector first on whose flash CRC differs, the image is padded with 0xff to whole sectors
+	async flashDiff(buf, first=0, cnt=Math.ceil(buf.length/0x1000)-first) {
+		const crcs=await this.flashCrcs(first*0x1000, cnt);
+		return crcs.map((c, i)=> {const s=Buffer.alloc(0x1000, 0xff); buf.copy(s, 0, (first+i)*0x1000, (first+i+1)*0x1000); return c!=UsbJtag.crc16(s);});
+	}
+
+	// SPI flash erase sector or block at address, WIP is polled on the device in 90 ms slices, opcode 0x02, 0x00/0x02
+	async flashErase(op, adr, ms) {
+		let [err]=await this.batch().spiWrite([0x06]).spiWrite([op, adr>>16&0xff, adr>>8&0xff, adr&0xff]).spiWait(90).readErr().exec();
+		for(let t=90;err && t<ms;t+=90) [err]=await this.batch().spiWait(90).readErr().exec();
+		if(err) throw("Error: flash erase timeout.");
+	}
+
+	// SPI flash erase plan for len bytes from address 0, 64 KiB blocks where fully covered, 4 KiB sectors elsewhere
+	// dirty limits it to the 4 KiB sectors flagged, blocks only where all 16 are
+	static flashPlan(len, dirty=null) {
+		const plan=[];
+		const end=Math.ceil(len/0x1000)*0x1000, d=(a)=> !dirty || dirty[a>>12];
+		for(let a=0;a<end;) {
+			if(!(a&0xffff) && a+0x10000<=end && Array.from({length: 16}, (_, i)=> d(a+i*0x1000)).every((x)=> x)) {plan.push([0xd8, a, 2000]); a+=0x10000;}
+			else {if(d(a)) plan.push([0x20, a, 400]); a+=0x1000;}
+		}
+		return plan;
+	}
+
+	// Split image into runs of pages that are not all 0xff, erased flash already holds 0xff
+	static *flashRuns(buf) {
+		const blank=(i)=> {for(let j=i;j<i+256 && j<buf.length;j++) if(buf[j]!=0xff) return false; return true;};
+		for(let i=0;i<buf.length;) {
+			while(i<buf.length && blank(i)) i+=256;
+			let j=i;
+			while(j<buf.length && !blank(j)) j+=256;
+			if(j>i) yield [i, buf.subarray(i, j)];
+			i=j;
+		}
+	}
+
+	// SPI flash program, runs are streamed to sink 0x02, the device opens, closes and waits for each page itself
+	async flashProgram(buf) {
+		const runs=[...UsbJtag.flashRuns(buf)];
+		const self=this;
+		await this.usbWritePipe((function*() {
+			for(const [a, d] of runs) yield* self.usbStream(0x02, d, [a&0xff, a>>8&0xff, a>>16&0xff, a>>>24]);
+		})());
+		if(await this.mcuReadErr()) throw("Error: flash program timeout.");
+		return runs.reduce((n, r)=> n+r[1].length, 0);
+	}
+
+	// SPI flash verify against image on the device, returns first mismatch offset, -1 if none
+	async flashVerify(buf) {return (await this.streamVerify(buf.length, {exp: buf, jtag: false, pre: [0x03, 0x00, 0x00, 0x00]})).bad;}
+
 	// Reset TAP
-	async fpgaRstTap() {await this.fpgaWriteJtag([0xff], [0x00]);}
+	async fpgaRstTap() {await this.batch().rstTap(true).exec();}
 
 	// Send JTAG command
-	async fpgaWriteCmd(cmd) {await this.fpgaWriteJtag([0x30, 0x80, 0x01], [0x00, cmd&0xff, 0x00]);}
+	async fpgaWriteCmd(cmd) {await this.shiftIr(cmd&0xff);}
 
 	// Read JTAG register
-	async fpgaReadReg(reg) {
-		await this.fpgaWriteCmd(reg);
-		return (await this.fpgaCallJtag([0x20, 0x00, 0x00, 0x00, 0x80, 0x01], [0x00, 0x00, 0x00, 0x00, 0x00, 0x00])).reverse().slice(1, 5);
-	}
+	async fpgaReadReg(reg) {return (await this.batch().readReg(reg).exec())[0];}
 
 	// Read FPGA ID
-	async fpgaReadId() {return Array.from(await this.fpgaReadReg(0x11), (b)=> {return ("0"+b.toString(16)).slice(-2);}).join("");}
+	async fpgaReadId() {return (await this.batch().readId().exec())[0];}
 
 	// Read FPGA CDONE status
-	async fpgaReadCdn() {return ((await this.fpgaReadReg(0x41))[2]&0x20)?true:false;}
+	async fpgaReadCdn() {return (await this.batch().readCdn().exec())[0];}
 
 	// FPGA reset SRAM
-	async fpgaRstSram() {
-		await this.fpgaWriteCmd(0x15);
-		await this.fpgaWriteCmd(0x05);
-		await this.fpgaWriteCmd(0x02);
-		await this.mcuDelay(10, 0);
-		await this.fpgaWriteCmd(0x09);
-		await this.fpgaWriteCmd(0x3a);
-		await this.fpgaWriteCmd(0x02);
+	async fpgaRstSram() {await this.batch().rstSram().exec();}
+
+	// Calibrate SPI clock divider and bitbang padding, steps up from the slowest setting until a check fails
+	// Padding is checked by IDCODE reads and bypass loopback scans, the divider by bypass loopback through the SPI fast path
+	// The fastest passing setting stays active and is saved to data flash next to the control byte unless save is false
+	async calibrate({save=true, rounds=4}={}) {
+		const pads=[16, 8, 4, 2, 1, 0], divs=[32, 16, 8, 4, 3, 2];
+		const pat=Array.from({length: 32}, (_, i)=> (i*0x9d+0x5a)&0xff);
+		const expScan=[...pat, 0].map((b, i)=> (b<<1|(i?pat[i-1]>>7:0))&0xff); // LSB first, one extra clock
+		const expSpi=(k)=> pat.map((b, i)=> b>>1|((i?pat[i-1]:k?pat[pat.length-1]:0)&1)<<7); // MSB first, continues the previous round
+		await this.mcuWriteRate(divs[0], pads[0]);
+		const id=await this.fpgaReadId();
+		if(id=="00000000" || id=="ffffffff") throw("Error: no JTAG target to calibrate against.");
+		const pass=async (div, pad, spi)=> {
+			try {
+				const bat=this.batch().rate(div, pad);
+				for(let i=0;i<rounds;i++) bat.readId();
+				bat.cmd(0xff); // Bypass, TDO is TDI delayed by one clock
+				if(spi) {bat.goto("DRSH"); for(let i=0;i<rounds;i++) bat.raw(0x01, 0x03, pat, pat.length);}
+				else for(let i=0;i<rounds;i++) bat.shift(false, [...pat, 0], pat.length*8+1, true);
+				const ret=await bat.exec();
+				if(ret.slice(0, rounds).some((r)=> r!=id)) return false;
+				return ret.slice(rounds).every((r, k)=> Buffer.from(spi?expSpi(k):expScan).equals(r));
+			}
+			catch(e) {this.tapState=null; return false;}
+		};
+		let pad=pads[0], div=divs[0];
+		if(!await pass(div, pad, false) || !await pass(div, pad, true)) throw("Error: calibration failed at the slowest setting.");
+		for(const p of pads.slice(1)) {if(!await pass(div, p, false)) break; pad=p;}
+		for(const d of divs.slice(1)) {if(!await pass(d, pad, true)) break; div=d;}
+		await this.mcuWriteRate(div, pad, save);
+		await this.fpgaRstTap();
+		return {id, div, pad, mhz: 16/div};
+	}
+
+	// Gowin .fs bitstream, ASCII '0' and '1' with '//' comment lines, yields chunks packed MSB first as they are parsed
+	// Packed data is cached by content hash, an index of path, size and mtime finds the hash so cache hits skip parsing
+	async *fsLoad(filename) {
+		const st=await fs.promises.stat(filename);
+		const key=path.resolve(filename);
+		const bin=await this.cacheGet(key, st, ".bin");
+		if(bin) {yield bin; return;}
+		const hash=crypto.createHash("sha256");
+		const out=[];
+		let acc=0, bits=0, cmt=false;
+		for await(const chunk of fs.createReadStream(filename, {highWaterMark: 0x10000})) {
+			hash.update(chunk);
+			const bin=Buffer.alloc((chunk.length>>3)+1);
+			let n=0;
+			for(const c of chunk) {
+				if(c==0x0a) cmt=false; // '\n'
+				else if(cmt) continue;
+				else if(c==0x2f) cmt=true; // '/'
+				else if(c==0x30 || c==0x31) {acc=acc<<1|(c&1); if(++bits==8) {bin[n++]=acc; acc=bits=0;}} // '0', '1'
+			}
+			if(n) {out.push(bin.subarray(0, n)); yield bin.subarray(0, n);}
+		}
+		if(bits) {const b=Buffer.from([acc<<(8-bits)]); out.push(b); yield b;} // Pad last byte
+		await this.cachePut(key, st, hash.digest("hex"), ".bin", Buffer.concat(out)); // Cache packed data
 	}
 
-	// FPGA program SRAM
+	// Cached data of a source file, index.json maps key to the size, mtime and content hash of the source
+	async cacheGet(key, st, ext) {
+		let index={};
+		try {index=JSON.parse(await fs.promises.readFile(path.join(this.fsCache, "index.json")));} catch(e) {;}
+		const ent=index[key];
+		if(!ent || ent.size!=st.size || ent.mtime!=st.mtimeMs) return null;
+		try {return await fs.promises.readFile(path.join(this.fsCache, ent.hash+ext));} catch(e) {return null;}
+	}
+
+	// Store cached data under its content hash and index it, a failed write leaves the cache as it was
+	async cachePut(key, st, hash, ext, buf) {
+		try {
+			const idx=path.join(this.fsCache, "index.json");
+			await fs.promises.mkdir(this.fsCache, {recursive: true});
+			const tmp=path.join(this.fsCache, `${hash}.${crypto.randomBytes(4).toString("hex")}.tmp`); // Unique per writer, adapters may load concurrently
+			await fs.promises.writeFile(tmp, buf);
+			await fs.promises.rename(tmp, path.join(this.fsCache, hash+ext));
+			let index={};
+			try {index=JSON.parse(await fs.promises.readFile(idx));} catch(e) {;}
+			index[key]={size: st.size, mtime: st.mtimeMs, hash};
+			await fs.promises.writeFile(idx, JSON.stringify(index));
+		}
+		catch(e) {;}
+	}
+
+	// Read bitstream image as chunks, .fs files are parsed, other files are raw binary
+	async *imageLoad(filename) {
+		if(path.extname(filename).toLowerCase()==".fs") yield* this.fsLoad(filename);
+		else yield await fs.promises.readFile(filename);
+	}
+
+	// FPGA program SRAM, each image chunk is streamed as soon as it is loaded
 	async fpgaWriteSram(filename) {
-		await this.fpgaWriteCmd(0x15);
-		await this.fpgaWriteCmd(0x12);
-		await this.fpgaWriteCmd(0x17);
-		await this.fpgaWriteJtag([0x20], [0x00]); // Shift-DR
-		const buf=await fs.promises.readFile(filename);
-		if(!buf) throw("Error: cannot read input file.");
-		const len=buf.length;
-		for(let i=0;i<buf.length;i+=62) {
-			const chunk=buf.slice(i, (len-i)>62?62+i:len);
-			await this.fpgaWriteJtag([], [...chunk], true);
-		}
-		await this.fpgaWriteJtag([0x03], [0x00]); // Idle
-		await this.fpgaWriteCmd(0x3a);
-		await this.fpgaWriteCmd(0x02);
+		await fs.promises.access(filename, fs.constants.R_OK).catch(()=> {throw("Error: cannot read input file.");});
+		let len=0;
+		const self=this;
+		await this.batch().cmd(0x15).cmd(0x12).cmd(0x17).goto("DRSH").exec(); // Shift-DR
+		await this.usbWritePipe((async function*() { // Stream JTAG fast write, compressed in 16 KiB pieces
+			for await(const buf of self.imageLoad(filename)) {len+=buf.length; for(let i=0;i<buf.length;i+=0x4000) yield* self.usbJtagStream(buf.subarray(i, i+0x4000));}
+		})());
+		await this.batch().cmd(0x3a).cmd(0x02).exec(); // Idle
 		return len;
 	}
 
-	// FPGA program flash
-	async fpgaWriteFlash(filename) {
-		throw("Error: function not implemented.");
+	// FPGA reset configuration, clears SRAM so the configuration flash is free for SPI access
+	async fpgaRstCfg() {await this.batch().rstPwr().rstTap().rstSram().exec();}
+
+	// FPGA read back SRAM, returns CRC of len bytes of readback data without sending them over USB
+	async fpgaReadSramCrc(len) {
+		await this.batch().cmd(0x15).cmd(0x03).goto("DRSH").exec(); // Shift-DR
+		const {crc}=await this.streamVerify(len); // Stream JTAG CRC
+		await this.batch().cmd(0x3a).cmd(0x02).exec(); // Idle
+		return crc;
+	}
+
+	// FPGA program flash, returns image size, programmed bytes, changed sectors and erase, program and verify times in ms
+	// diff compares per-sector CRCs first and only erases and programs the 4 KiB sectors that differ, then verifies those by CRC
+	async fpgaWriteFlash(filename, verify=true, diff=false) {
+		const bufs=[];
+		for await(const b of this.imageLoad(filename)) bufs.push(b);
+		let buf=Buffer.concat(bufs);
+		const len=buf.length, ms=(t)=> {t=process.hrtime(t); return t[0]*1000+t[1]/1000000;};
+		let t=process.hrtime();
+		await this.mcuReadErr(); // Clear error status
+		const dirty=diff?await this.flashDiff(buf):null;
+		if(dirty) {buf=Buffer.from(buf); dirty.forEach((d, i)=> {if(!d) buf.fill(0xff, i*0x1000, (i+1)*0x1000);});} // Unchanged sectors are left alone
+		for(const [op, adr, tmo] of UsbJtag.flashPlan(len, dirty)) await this.flashErase(op, adr, tmo);
+		const tErase=ms(t);
+		t=process.hrtime();
+		const prog=await this.flashProgram(buf);
+		const tProg=ms(t);
+		t=process.hrtime();
+		let bad=-1;
+		if(verify && dirty) for(let i=0, j;i<dirty.length && bad<0;i=j) { // Changed runs only
+			for(j=i;j<dirty.length && dirty[j]==dirty[i];j++);
+			const k=dirty[i]?(await this.flashDiff(buf, i, j-i)).indexOf(true):-1;
+			if(k>=0) bad=(i+k)*0x1000;
+		}
+		else if(verify) bad=await this.flashVerify(buf);
+		const tVerify=ms(t);
+		if(bad>=0) throw(`Error: flash verify failed at 0x${bad.toString(16)}.`);
+		return {len, prog, sectors: dirty?dirty.filter((d)=> d).length:Math.ceil(len/0x1000), tErase, tProg, tVerify};
 	}
 }
 
@@ -0,0 +1,234 @@
+#!/usr/bin/env node
+
+// Copyright (c) 2020-2021, Bo Gao <7zlaser@gmail.com>
+
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+// OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+// SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THE
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Xilinx Virtual Cable 1.0 server on top of UsbJtag
+// Usage: node xvc.js, runs a local XVC client against the emulated adapter
+
+const net=require("net");
+const UsbJtag=require("./usbjtag");
+
+const XVC_MAX=2048; // Vector bytes per shift
+
+class XvcServer {
+	// Private members
+	#jtag;
+	#lock=Promise.resolve();
+
+	constructor(jtag) {this.#jtag=jtag;}
+
+	// Plan a shift into batch sub-commands, returns TDO ops as [offset, bits, msb]
+	// TDI and TDO only matter in Shift-IR/DR, so TMS high bits outside them go into scan paths with TDI low
+	// Long TMS low runs go through the SPI fast path, state is tracked from TMS and unknown until 5 TMS high clocks
+	plan(ctx, n, tms, tdi, bat) {
+		const bit=(b, i)=> b[i>>3]>>(i&7)&1;
+		const data=new Uint8Array(n);
+		for(let i=0;i<n;i++) {
+			const m=bit(tms, i);
+			data[i]=!m || !ctx.state || ctx.state=="IRSH" || ctx.state=="DRSH";
+			ctx.ones=m?ctx.ones+1:0;
+			ctx.state=ctx.state?UsbJtag.tapNext(ctx.state, m):(ctx.ones>=5?"RESET":null);
+		}
+		const ops=[];
+		const pack=(s, len)=> {const r=new Array((len+7)>>3).fill(0); for(let k=0;k<len;k++) r[k>>3]|=bit(tdi, s+k)<<(k&7); return r;};
+		for(let i=0;i<n;) {
+			let ent=0, entN=0;
+			while(i<n && !data[i] && entN<8) ent|=bit(tms, i++)<<entN++; // Entry path
+			let s=i;
+			while(i<n && data[i] && !bit(tms, i) && i-s<439) i++; // TMS low data
+			if(i-s>=128) { // Head bits by scan, whole bytes by SPI fast path
+				const head=(i-s)&7;
+				if(head || entN) {bat.scan(pack(s, head), head, [ent, entN], [0, 0], head>0); if(head) ops.push([s, head, false]);}
+				for(let k=s+head;k<i;k+=472) {
+					const len=Math.min(59, (i-k)>>3);
+					const b=Array.from({length: len}, (_, j)=> {let v=0; for(let q=0;q<8;q++) v|=bit(tdi, k+j*8+q)<<(7-q); return v;});
+					bat.raw(0x01, 0x03, b, len);
+					ops.push([k, len*8, true]);
+				}
+				ent=entN=0; s=i;
+			}
+			if(i<n && data[i] && bit(tms, i)) i++; // Exit bit
+			const len=i-s;
+			let ext=0, extN=0;
+			if(len) {ext=bit(tms, i-1); extN=1; while(i<n && !data[i] && extN<8) ext|=bit(tms, i++)<<extN++; if(extN==1 && !ext) extN=0;}
+			if(len || entN || extN) bat.scan(pack(s, len), len, [ent, entN], [ext, extN], len>0);
+			if(len) ops.push([s, len, false]);
+		}
+		return ops;
+	}
+
+	// Shift n bits, returns TDO vector
+	async shift(ctx, n, tms, tdi) {
+		const bat=this.#jtag.batch();
+		const ops=this.plan(ctx, n, tms, tdi, bat);
+		const res=await bat.exec();
+		const tdo=Buffer.alloc((n+7)>>3);
+		ops.forEach(([s, len, msb], k)=> {
+			for(let j=0;j<len;j++) if(res[k][j>>3]>>(msb?7-(j&7):j&7)&1) tdo[(s+j)>>3]|=1<<((s+j)&7);
+		});
+		return tdo;
+	}
+
+	// Set TCK period through the SPI clock divider, bitbang padding is kept, returns the period in use
+	async settck(ns) {
+		const div=Math.min(64, Math.max(2, Math.round(ns*16/1000)));
+		const {pad}=await this.#jtag.mcuReadRate(false);
+		await this.#jtag.mcuWriteRate(div, pad, false);
+		return Math.round(div*1000/16);
+	}
+
+	// Serve one connection, requests from all connections are serialized on the adapter
+	serve(sock) {
+		const ctx={state: null, ones: 0, shifts: 0, bits: 0, t: process.hrtime(), peer: `${sock.remoteAddress}:${sock.remotePort}`};
+		let buf=Buffer.alloc(0), busy=false;
+		const run=async ()=> {
+			if(busy) return;
+			busy=true;
+			try {
+				for(;;) {
+					let len=0, ret=null;
+					if(buf.length>=8 && buf.subarray(0, 8).toString()=="getinfo:") {len=8; ret=Buffer.from(`xvcServer_v1.0:${XVC_MAX}\n`);}
+					else if(buf.length>=11 && buf.subarray(0, 7).toString()=="settck:") {
+						len=11;
+						const job=this.#lock.then(()=> this.settck(buf.readUInt32LE(7)));
+						this.#lock=job.catch(()=> {;});
+						ret=Buffer.alloc(4); ret.writeUInt32LE(await job);
+					}
+					else if(buf.length>=10 && buf.subarray(0, 6).toString()=="shift:") {
+						const n=buf.readUInt32LE(6), nb=(n+7)>>3;
+						if(nb>XVC_MAX) throw("Error: XVC vector too long.");
+						if(buf.length<10+2*nb) break;
+						len=10+2*nb;
+						const tms=buf.subarray(10, 10+nb), tdi=buf.subarray(10+nb, 10+2*nb);
+						const job=this.#lock.then(()=> this.shift(ctx, n, tms, tdi));
+						this.#lock=job.catch(()=> {;});
+						ret=await job;
+						ctx.shifts++; ctx.bits+=n;
+					}
+					else if(buf.length>=11 || (buf.length && !"getinfo:settck:shift:".includes(buf.subarray(0, Math.min(buf.length, 6)).toString()))) throw("Error: invalid XVC command.");
+					else break;
+					buf=buf.subarray(len);
+					sock.write(ret);
+				}
+			}
+			catch(e) {console.log(e); sock.destroy();}
+			busy=false;
+			if(buf.length>=8) run();
+		};
+		sock.on("data", (d)=> {buf=Buffer.concat([buf, d]); run();});
+		sock.on("error", ()=> {;});
+		sock.on("close", ()=> {
+			const t=process.hrtime(ctx.t);
+			const ms=t[0]*1000+t[1]/1000000;
+			console.log(`XVC ${ctx.peer}: ${ctx.shifts} shifts, ${ctx.bits} bits, ${ms.toFixed(2)} ms, ${(ctx.bits/1000/ms).toFixed(3)} Mbps`);
+		});
+	}
+
+	// Listen on port, resolves with the server
+	listen(port=2542, host="127.0.0.1") {
+		const srv=net.createServer((sock)=> this.serve(sock));
+		return new Promise((res, rej)=> {srv.once("error", rej); srv.listen(port, host, ()=> res(srv));});
+	}
+}
+
+// XVC client, resolves requests in order
+class XvcClient {
+	#sock;
+	#buf=Buffer.alloc(0);
+	#wait=[];
+
+	async connect(port, host="127.0.0.1") {
+		this.#sock=net.connect(port, host);
+		this.#sock.on("data", (d)=> {this.#buf=Buffer.concat([this.#buf, d]); this.#pump();});
+		await new Promise((res, rej)=> {this.#sock.once("connect", res); this.#sock.once("error", rej);});
+	}
+
+	#pump() {
+		while(this.#wait.length) {
+			const w=this.#wait[0];
+			const len=w.len<0?this.#buf.indexOf(0x0a)+1:w.len;
+			if(len<=0 || this.#buf.length<len) return;
+			this.#wait.shift();
+			w.res(this.#buf.subarray(0, len));
+			this.#buf=this.#buf.subarray(len);
+		}
+	}
+
+	#req(dat, len) {return new Promise((res)=> {this.#wait.push({res, len}); this.#sock.write(dat); this.#pump();});}
+
+	async getinfo() {return (await this.#req("getinfo:", -1)).toString().trim();}
+
+	async settck(ns) {const b=Buffer.alloc(4); b.writeUInt32LE(ns); return (await this.#req(Buffer.concat([Buffer.from("settck:"), b]), 4)).readUInt32LE(0);}
+
+	// Shift bit arrays, returns TDO bit array
+	async shift(tms, tdi) {
+		const n=tms.length, nb=(n+7)>>3;
+		const b=Buffer.alloc(10+2*nb);
+		b.write("shift:"); b.writeUInt32LE(n, 6);
+		for(let i=0;i<n;i++) {b[10+(i>>3)]|=tms[i]<<(i&7); b[10+nb+(i>>3)]|=tdi[i]<<(i&7);}
+		const r=await this.#req(b, nb);
+		return Array.from({length: n}, (_, i)=> r[i>>3]>>(i&7)&1);
+	}
+
+	close() {this.#sock.end();}
+}
+
+// Local client check against the emulated adapter, reads IDCODE and writes then reads back SRAM
+async function main() {
+	const {UsbEmu}=require("./usbemu");
+	const emu=new UsbEmu;
+	const jtag=new UsbJtag;
+	await jtag.open(emu);
+	const srv=await new XvcServer(jtag).listen(0);
+	const cli=new XvcClient;
+	await cli.connect(srv.address().port);
+	const bits=(v, n)=> Array.from({length: n}, (_, i)=> v>>i&1);
+	const ir=async (v)=> await cli.shift([1, 1, 0, 0, ...bits(0, 7), 1, 1, 0], [0, 0, 0, 0, ...bits(v, 8), 0, 0]); // Idle to Shift-IR, 8 bits, Idle
+	const dr=async (tdi)=> (await cli.shift([1, 0, 0, ...tdi.map((_, i)=> i==tdi.length-1?1:0), 1, 0], [0, 0, 0, ...tdi, 0, 0])).slice(3, 3+tdi.length);
+	let fail=0;
+	console.log(await cli.getinfo());
+	console.log(`TCK period: ${await cli.settck(100)} ns`);
+	if(await cli.settck(500)!=500 || (await jtag.mcuReadRate(false)).div!=8) fail++;
+	await cli.settck(100);
+	await cli.shift([1, 1, 1, 1, 1, 0], [0, 0, 0, 0, 0, 0]); // Reset to Idle
+	await ir(0x11);
+	const id=(await dr(bits(0, 32))).reduce((v, b, i)=> v|b<<i, 0)>>>0;
+	console.log(`JTAG ID: ${id.toString(16).padStart(8, "0")}`);
+	if(id!=emu.tap.id) fail++;
+	const img=Array.from({length: 8192}, (_, i)=> (i*7919>>3^i)&1);
+	await ir(0x15); await ir(0x12); await ir(0x17);
+	await dr(img);
+	await ir(0x03);
+	const rb=await dr(new Array(img.length).fill(0));
+	await ir(0x3a);
+	if(rb.some((b, i)=> b!=img[i])) fail++;
+	console.log(`SRAM write and readback: ${img.length} bits, ${fail?"fail":"pass"}`);
+	cli.close();
+	setTimeout(()=> {srv.close(); process.exit(fail?-1:0);}, 10);
+}
+
+if(require.main===module) main();
+
+module.exports={XvcServer, XvcClient};